@@ -1,6 +1,7 @@
 #ifndef DBHC_ALGORITHM_H
 #define DBHC_ALGORITHM_H
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <iostream>
@@ -737,6 +738,19 @@ namespace dbhc {
     std::sort(begin(e), end(e), [f](const T& l, const T& r) { return f(l) > f(r); });
   }
 
+  // Pointer to the value at a, or nullptr, with a single lookup
+  template<typename A, typename B>
+  const B* find_value(const A& a, const std::unordered_map<A, B>& m) {
+    auto f = m.find(a);
+    return f == std::end(m) ? nullptr : &(f->second);
+  }
+
+  template<typename A, typename B>
+  const B* find_value(const A& a, const std::map<A, B>& m) {
+    auto f = m.find(a);
+    return f == std::end(m) ? nullptr : &(f->second);
+  }
+
   template<typename A, typename B>
   bool contains_key(const A& a, const std::unordered_map<A, B>& m) {
     auto f = m.find(a);
@@ -797,14 +811,25 @@ namespace dbhc {
   public:
 
     maybe(const T& value_) : value(value_), has_val(true) {}
+    maybe(T&& value_) : value(std::move(value_)), has_val(true) {}
     maybe() : has_val(false) {}
                                                          
     bool has_value() const { return has_val; }
 
-    T get_value() const {
+    const T& get_value() const & {
       assert(has_value());
       return value;
     }
+
+    T& get_value() & {
+      assert(has_value());
+      return value;
+    }
+
+    T get_value() && {
+      assert(has_value());
+      return std::move(value);
+    }
   };
 
 }
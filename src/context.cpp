@@ -1,5 +1,10 @@
 #include "context.h"
 
+#include "expression_matrix.h"
+#include "filter.h"
+#include "fixed_context.h"
+#include "gmp_pool.h"
+
 #include <cassert>
 
 using namespace std;
@@ -16,143 +21,387 @@ namespace LinCAD {
     cout << " )";
   }
   
-  std::vector<rational> build_test_points(const std::vector<rational>& sorted_roots) {
+  sign_pattern compile_constraints(const std::vector<constraint>& constraints) {
+    sign_pattern pattern(constraints.size());
+    for (int i = 0; i < (int) constraints.size(); i++) {
+      switch (constraints[i].second) {
+      case EQUAL_ZERO:
+        pattern.require(i, 1, pack_sign(0));
+        break;
+      case NOT_EQUAL_ZERO:
+        pattern.require(i, 1, pack_sign(1));
+        break;
+      case LESS_THAN_ZERO:
+        pattern.require(i, 3, pack_sign(-1));
+        break;
+      case GREATER_THAN_ZERO:
+        pattern.require(i, 3, pack_sign(1));
+        break;
+      }
+    }
+    return pattern;
+  }
+
+  rational simplest_between(const rational& a, const rational& b) {
+    if (a.sign() < 0 && b.sign() > 0) {
+      return rational::zero();
+    }
+
+    if (b.sign() <= 0) {
+      return -simplest_between(-b, -a);
+    }
+
+    rational fl = a.floor();
+    rational next = fl + rational::one();
+    if (next < b) {
+      return next;
+    }
+
+    // a and b lie in [fl, fl + 1], so the sample is fl + 1 / y for the
+    // simplest y in (1 / (b - fl), 1 / (a - fl))
+    rational lo = rational::one() / (b - fl);
+    if (a == fl) {
+      return fl + rational::one() / (lo.floor() + rational::one());
+    }
+
+    rational hi = rational::one() / (a - fl);
+    return fl + rational::one() / simplest_between(lo, hi);
+  }
+
+  std::vector<rational> build_test_points(const std::vector<rational>& sorted_roots,
+                                          const sample_mode mode) {
     if (sorted_roots.size() == 0) {
-      return {rational("0")};
+      return {rational::zero()};
     }
 
-    rational fst_root = sorted_roots.front();
-    rational last_root = sorted_roots.back();
+    const rational& fst_root = sorted_roots.front();
+    const rational& last_root = sorted_roots.back();
 
     vector<rational> test_points;
-    test_points.push_back(fst_root - rational("1"));
+    if (mode == SIMPLEST_SAMPLES) {
+      rational below = fst_root.ceil() - rational::one();
+      test_points.push_back(below.sign() < 0 ? below : rational::zero());
+    } else {
+      test_points.push_back(fst_root - rational::one());
+    }
 
     for (int i = 0; i < ((int) sorted_roots.size()); i++) {
       test_points.push_back(sorted_roots[i]);
 
       if (i < (((int)sorted_roots.size()) - 1)) {
-        test_points.push_back((sorted_roots[i] + sorted_roots[i + 1]) / rational("2"));
+        if (mode == SIMPLEST_SAMPLES) {
+          test_points.push_back(simplest_between(sorted_roots[i], sorted_roots[i + 1]));
+        } else {
+          test_points.push_back((sorted_roots[i] + sorted_roots[i + 1]) / rational(2));
+        }
       }
     }
 
-    test_points.push_back(last_root + rational("1"));
+    if (mode == SIMPLEST_SAMPLES) {
+      rational above = last_root.floor() + rational::one();
+      test_points.push_back(above.sign() > 0 ? above : rational::zero());
+    } else {
+      test_points.push_back(last_root + rational::one());
+    }
 
     return test_points;
   }
 
-  std::vector<rational>
-  ordered_roots(const std::vector<linear_expression*>& base_set,
-                const map<variable, rational>& test_point) {
-    vector<rational> results;
+  // Roots of one lifting level in solved form, stored by the variable
+  // they depend on so that assigning a variable only touches its column
+  struct root_columns {
+    std::vector<rational> consts;
+    std::vector<std::vector<std::pair<int, rational> > > columns;
+
+    root_columns(const expression_matrix& solved) {
+      for (int r = 0; r < solved.num_rows(); r++) {
+        consts.push_back(solved.row_const(r));
+        for (int k = solved.row_begin(r); k < solved.row_end(r); k++) {
+          variable v = solved.entry_var(k);
+          if (v >= (int) columns.size()) {
+            columns.resize(v + 1);
+          }
+          columns[v].push_back({r, solved.entry_coeff(k)});
+        }
+      }
+    }
+  };
 
-    for (auto expr : base_set) {
-      linear_expression res = expr->evaluate_at(test_point);
+  linear_expression
+  linear_expression::evaluate_at(const std::map<variable, rational>& var_values) const {
 
-      cout << *expr << " at ";
-      print_point(test_point);
-      cout << " has value " << res << endl;
+    coeff_vector un_evaluated;
+    rational fresh_const = c;
+    for (const auto& cf : coeffs) {
+      const rational* val = find_value(cf.first, var_values);
+      if (val != nullptr) {
+        fresh_const.addmul(*val, cf.second);
+      } else {
+        un_evaluated.push_back(cf);
+      }
+    }
 
-      assert(res.num_non_zero_coeffs() == 1);
-      rational b = res.get_const();
-      rational a = res.get_only_non_zero_coeff();
+    return from_sorted(std::move(un_evaluated), std::move(fresh_const), content);
+  }
 
-      assert(a != rational("0"));
+  int
+  linear_expression::sign_at(const std::map<variable, rational>& var_values) const {
+    // content > 0, so the sign is that of the integer part
+    interval acc = to_interval(c);
+    for (const auto& cf : coeffs) {
+      const rational* val = find_value(cf.first, var_values);
+      assert(val != nullptr);
+      acc = acc + to_interval(cf.second) * to_interval(*val);
+    }
 
-      results.push_back((-b) / a);
+    if (acc.excludes_zero()) {
+      record_filter_hit();
+      return acc.sign();
     }
-    return sort_unique(results);
+
+    record_filter_miss();
+    rational exact = c;
+    for (const auto& cf : coeffs) {
+      exact.addmul(*find_value(cf.first, var_values), cf.second);
+    }
+    return exact.sign();
   }
 
   linear_expression
-  linear_expression::evaluate_at(const std::map<variable, rational>& var_values) const {
+  linear_expression::combine(const rational& sa,
+                             const linear_expression& other,
+                             const rational& sb) const {
+    rational ka = sa * content;
+    rational kb = sb * other.content;
+    rational g = gcd(ka, kb);
+    if (g.sign() == 0) {
+      return linear_expression({}, rational::zero());
+    }
 
-    map<variable, rational> un_evaluated;
-    rational fresh_const = get_const();
-    for (auto cf : coeffs) {
-      if (contains_key(cf.first, var_values)) {
-        fresh_const = fresh_const + map_find(cf.first, var_values)*cf.second;
+    // Both multipliers are integers, so the combination stays integral
+    ka /= g;
+    kb /= g;
+
+    coeff_vector comb_coeffs;
+    comb_coeffs.reserve(coeffs.size() + other.coeffs.size());
+    auto a = begin(coeffs);
+    auto b = begin(other.coeffs);
+    while (a != end(coeffs) || b != end(other.coeffs)) {
+      if (b == end(other.coeffs) || (a != end(coeffs) && a->first < b->first)) {
+        comb_coeffs.emplace_back(a->first, a->second * ka);
+        ++a;
+      } else if (a == end(coeffs) || b->first < a->first) {
+        comb_coeffs.emplace_back(b->first, b->second * kb);
+        ++b;
       } else {
-        un_evaluated.insert(cf);
+        rational v = a->second * ka;
+        v.addmul(b->second, kb);
+        comb_coeffs.emplace_back(a->first, std::move(v));
+        ++a;
+        ++b;
       }
     }
 
-    return linear_expression(un_evaluated, fresh_const);
+    rational comb_const = c * ka;
+    comb_const.addmul(other.c, kb);
+
+    return from_sorted(std::move(comb_coeffs), std::move(comb_const), std::move(g));
   }
 
-  
-  void lift(const std::vector<std::vector<linear_expression*> >& projection_sets,
+  // How to read the sign of each expression recorded at the leaves. An
+  // expression that mentions the last lifted variable has its root at
+  // row solved_row of the bottom level, and its sign at a sample is
+  // cof_sign times the side of that root the sample lies on. Any other
+  // expression has one sign over the whole parent cell.
+  struct leaf_sign_plan {
+    std::vector<const linear_expression*> exprs;
+    std::vector<int> solved_row;
+    std::vector<int> cof_sign;
+
+    // Scratch for the current parent cell
+    std::vector<rational> roots;
+    std::vector<int> fixed_signs;
+  };
+
+  // partial_roots[i][j] holds the roots of level j <= i with the
+  // variables assigned above level i substituted, so partial_roots[i][i]
+  // are the finished roots of level i. Each child only adds its own
+  // variable's column to the parent's partial roots.
+  void lift(const std::vector<root_columns>& levels,
             const std::vector<variable>& variable_order,
             const int i,
             const map<variable, rational>& test_point,
+            const sample_mode mode,
+            std::vector<std::vector<std::vector<rational> > >& partial_roots,
+            root_sort_buffer& sort_buf,
+            leaf_sign_plan& leaf_plan,
+            sign_invariant_partition& sid,
             cell* cl) {
 
     //cout << "i = " << i << endl;
-    assert(projection_sets.size() == variable_order.size());
-    assert(i <= ((int) projection_sets.size()));
+    assert(levels.size() == variable_order.size());
+    assert(i <= ((int) levels.size()));
 
     if (i == -1) {
       return;
     }
 
-    const vector<linear_expression*>& base_set = projection_sets[i];
-    vector<rational> roots = ordered_roots(base_set, test_point);
+    variable var = variable_order[i];
 
-    vector<rational> test_points = build_test_points(roots);
+    // The finished roots of this level are not read again below it, so
+    // they are sorted in place
+    vector<vector<rational> >& partial = partial_roots[i];
+
+    if (i == 0) {
+      int n = leaf_plan.exprs.size();
+      leaf_plan.roots.resize(n);
+      leaf_plan.fixed_signs.resize(n);
+      for (int k = 0; k < n; k++) {
+        if (leaf_plan.solved_row[k] != -1) {
+          leaf_plan.roots[k] = partial[0][leaf_plan.solved_row[k]];
+        } else {
+          leaf_plan.fixed_signs[k] = leaf_plan.exprs[k]->sign_at(test_point);
+        }
+      }
+    }
+
+    sort_unique_roots(partial[i], sort_buf);
+
+    vector<rational> test_points = build_test_points(partial[i], mode);
     cout << "Base test points" << endl;
     for (auto r : test_points) {
       cout << "\t" << r << endl;
     }
 
-    variable var = variable_order[i];
+    int depth = ((int) levels.size()) - 1 - i;
+    for (auto& r : test_points) {
+      sid.record_sample(depth, r);
+
+      if (i == 0) {
+        sign_vectors& leaf_signs = sid.get_leaf_signs();
+        int v = leaf_signs.add_vector();
+        for (int k = 0; k < (int) leaf_plan.exprs.size(); k++) {
+          int sign = leaf_plan.solved_row[k] == -1 ? leaf_plan.fixed_signs[k] :
+            leaf_plan.cof_sign[k] * r.compare(leaf_plan.roots[k]);
+          leaf_signs.set(v, k, sign);
+        }
+      }
+
+      if (i > 0) {
+        vector<vector<rational> >& child = partial_roots[i - 1];
+        for (int j = 0; j < i; j++) {
+          child[j] = partial[j];
+          if (var < (int) levels[j].columns.size()) {
+            for (const auto& entry : levels[j].columns[var]) {
+              child[j][entry.first].addmul(r, entry.second);
+            }
+          }
+        }
+      }
 
-    for (auto r : test_points) {
       map<variable, rational> fresh_test_point = test_point;
-      fresh_test_point[var] = r;
-      cell* fresh_cell = cl->add_child(fresh_test_point);
-      lift(projection_sets, variable_order, i - 1, fresh_test_point, fresh_cell);
+      fresh_test_point[var] = std::move(r);
+      cell* fresh_cell = cl->add_child(std::move(fresh_test_point));
+      lift(levels, variable_order, i - 1, fresh_cell->get_test_point(),
+           mode, partial_roots, sort_buf, leaf_plan, sid, fresh_cell);
     }
 
     
   }
 
-  std::vector<linear_expression*>
-  context::project_away(const std::vector<linear_expression*>& exprs,
+  std::vector<const linear_expression*>
+  context::project_away(const std::vector<const linear_expression*>& exprs,
                         const variable var) {
-
-    vector<linear_expression*> proj_set;
-    // TODO: Add expressions that do not depend on var (vertical lines wrt var)
+    expression_matrix rows;
     for (auto expr : exprs) {
+      rows.add_canonical_row(*expr);
+    }
+
+    expression_matrix proj = project_away(rows, var);
+
+    vector<const linear_expression*> proj_set;
+    for (int r = 0; r < proj.num_rows(); r++) {
+      proj_set.push_back(add_linear_expression(proj.row_expression(r)));
+    }
+    return proj_set;
+  }
+
+  expression_matrix
+  context::project_away(const expression_matrix& exprs,
+                        const variable var) {
+    int width = use_dense_rows(exprs.num_rows(), exprs.num_non_zeros()) ?
+      next_var + 1 : 0;
+    rational_table* table = intern_rationals ? &rational_constants : nullptr;
 
-      if (expr->cof(var).sign() == 0) {
-        proj_set.push_back(expr);
+    expression_matrix proj_set;
+    if (exprs.has_provenance()) {
+      proj_set.record_provenance();
+    }
+    // Rows without var pass through. A pair where only one row mentions
+    // var gives a multiple of the other, so resultants are only formed
+    // among the rows that mention it.
+    vector<int> mentioning;
+    for (int r = 0; r < exprs.num_rows(); r++) {
+      if (exprs.row_cof(r, var).sign() == 0) {
+        proj_set.add_canonical_row(exprs, r);
+      } else {
+        mentioning.push_back(r);
       }
     }
-    
-    // Add all possible root expressions
-    
-    for (int i = 0; i < (int) exprs.size(); i++) {
-      linear_expression* la = exprs[i];
-      for (int j = i + 1; j < (int) exprs.size(); j++) {
-        linear_expression* lb = exprs[j];
-
-        // Compute cof(var, lb)*drop(var, la) - cof(var, la)*drop(var, lb)
-        linear_expression lhs =
-          la->drop(var).scalar_mul(lb->cof(var));
-        linear_expression rhs =
-          lb->drop(var).scalar_mul(la->cof(var));
-
-        linear_expression res =
-          lhs.subtract(rhs);
-          
-        linear_expression* res_e = add_linear_expression(res);
-        proj_set.push_back(res_e);
+
+    for (int i = 0; i < (int) mentioning.size(); i++) {
+      for (int j = i + 1; j < (int) mentioning.size(); j++) {
+        proj_set.add_canonical_elimination(exprs, mentioning[i], mentioning[j],
+                                           var, width, table);
       }
     }
     return proj_set;
   }
 
+  bool context::use_dense_rows(const int num_exprs, const int num_non_zeros) const {
+    if (layout == SPARSE_ROWS || next_var + 1 > dense_row_width) {
+      return false;
+    }
+
+    if (layout == DENSE_ROWS) {
+      return true;
+    }
+
+    if (next_var > 8 || num_exprs == 0) {
+      return false;
+    }
+
+    // Dense when the expressions mention at least half of the variables
+    // on average
+    return 2 * num_non_zeros >= next_var * num_exprs;
+  }
+
+  std::vector<expression_matrix>
+  context::project(const std::set<const linear_expression*>& lin_exprs) {
+    vector<expression_matrix> projection_sets;
+    projection_sets.push_back(expression_matrix());
+    if (record_provenance) {
+      projection_sets.back().record_provenance();
+    }
+    for (auto expr : lin_exprs) {
+      projection_sets.back().add_canonical_row(*expr);
+    }
+
+    for (variable var = 1; var < next_var; var++) {
+      projection_sets.push_back(project_away(projection_sets.back(), var));
+    }
+    return projection_sets;
+  }
+
   sign_invariant_partition
-  context::build_sign_invariant_partition(const std::set<linear_expression*>& lin_exprs) {
+  context::build_sign_invariant_partition(const std::set<const linear_expression*>& lin_exprs) {
+    return build_partition(lin_exprs,
+                           vector<const linear_expression*>(begin(lin_exprs), end(lin_exprs)));
+  }
+
+  sign_invariant_partition
+  context::build_partition(const std::set<const linear_expression*>& lin_exprs,
+                           const std::vector<const linear_expression*>& leaf_exprs) {
     // Choose variable order
     vector<variable> variable_order;
     for (int i = 0; i < next_var; i++) {
@@ -160,38 +409,89 @@ namespace LinCAD {
     }
 
     // Projection phase: build each projection set
-    vector<vector<linear_expression*> > projection_sets;
-    projection_sets.push_back(vector<linear_expression*>(begin(lin_exprs), end(lin_exprs)));
-
-    for (int i = 1; i < variable_order.size(); i++) {
-      variable var = variable_order[i];
-      projection_sets.push_back(project_away(projection_sets[i - 1], var));
-    }
+    vector<expression_matrix> projection_sets = project(lin_exprs);
 
+    size_t footprint = 0;
     cout << "Projection sets" << endl;
-    for (int i = 0; i < projection_sets.size(); i++) {
+    for (int i = 0; i < (int) projection_sets.size(); i++) {
       cout << "\tProjection set " << i << endl;
-      for (auto p : projection_sets[i]) {
-        cout << "\t\t" << *p << endl;
-      }
+      projection_sets[i].print(cout);
+      footprint += projection_sets[i].footprint_bytes();
     }
 
-    assert(projection_sets.size() == ((int) variable_order.size()));
+    assert(projection_sets.size() == variable_order.size());
 
     // Base and lift phase: Solve one dimensional system wrt variable 0,
     // then back-substitute
     sign_invariant_partition sid;
+    sid.set_projection_footprint(footprint);
 
     map<variable, rational> test_point{};
 
-    // Q: Why does this need to be reversed?
-    reverse(variable_order);
+    // projection_sets[i] has eliminated variable_order[1..i], so below the
+    // top its roots are taken in variable_order[i + 1], and the last set
+    // only mentions variable_order[0]
+    vector<variable> lift_order;
+    for (int i = 1; i < (int) variable_order.size(); i++) {
+      lift_order.push_back(variable_order[i]);
+    }
+    if (variable_order.size() > 0) {
+      lift_order.push_back(variable_order[0]);
+    }
+
+    // Each level's roots in its lifting variable, solved once up front
+    vector<root_columns> levels;
+    for (int i = 0; i < (int) projection_sets.size(); i++) {
+      levels.push_back(root_columns(projection_sets[i].solved_for(lift_order[i])));
+    }
+
+    // Each leaf expression is in the bottom projection set, which holds
+    // the canonical forms of the inputs
+    leaf_sign_plan leaf_plan;
+    sid.set_num_leaf_signs(leaf_exprs.size());
+    if (levels.size() > 0) {
+      vector<int> solved_index;
+      int num_solved = 0;
+      for (int r = 0; r < projection_sets[0].num_rows(); r++) {
+        bool mentions = projection_sets[0].row_cof(r, lift_order[0]).sign() != 0;
+        solved_index.push_back(mentions ? num_solved++ : -1);
+      }
+
+      for (auto expr : leaf_exprs) {
+        int cof_sign = expr->integer_cof(lift_order[0]).sign();
+        int row = -1;
+        if (cof_sign != 0) {
+          row = projection_sets[0].find_canonical_row(*expr);
+          assert(row != -1);
+          row = solved_index[row];
+        }
+
+        leaf_plan.exprs.push_back(expr);
+        leaf_plan.solved_row.push_back(row);
+        leaf_plan.cof_sign.push_back(cof_sign);
+      }
+    }
+
+    int top = ((int) levels.size()) - 1;
+    vector<vector<vector<rational> > > partial_roots(levels.size());
+    for (int i = 0; i <= top; i++) {
+      partial_roots[i].resize(i + 1);
+    }
+    for (int j = 0; j <= top; j++) {
+      partial_roots[top][j] = levels[j].consts;
+    }
     
+    root_sort_buffer sort_buf;
     cell* c = sid.get_root_cell();
-    lift(projection_sets,
-         variable_order,
-         ((int) projection_sets.size()) - 1,
+    lift(levels,
+         lift_order,
+         top,
          test_point,
+         samples,
+         partial_roots,
+         sort_buf,
+         leaf_plan,
+         sid,
          c);
 
     return sid;
@@ -200,46 +500,83 @@ namespace LinCAD {
 
   maybe<std::map<variable, rational> >
   context::solve_constraints() {
-    set<linear_expression*> exprs;
-    for (auto constraint : active_constraints) {
-      exprs.insert(constraint.first);
+    maybe<test_pt> model;
+    {
+      gmp_arena arena;
+      model = fixed_dimensions && next_var >= 1 && next_var <= 4 ?
+        find_fixed_model() : find_model();
     }
 
-    sign_invariant_partition sid =
-      build_sign_invariant_partition(exprs);
+    // The arena is closed, move the model's big values to cells of their
+    // own so the arena is released as soon as the solver's values are gone
+    if (model.has_value()) {
+      for (auto& val : model.get_value()) {
+        val.second.unshare();
+      }
+    }
+
+    return model;
+  }
 
-    for (auto pt : sid.test_points()) {
-      bool satisfies_all_constraints = true;
+  maybe<std::map<variable, rational> >
+  context::find_fixed_model() {
+    switch (next_var) {
+    case 1:
+      return fixed_context<1>(active_constraints, samples).solve();
+    case 2:
+      return fixed_context<2>(active_constraints, samples).solve();
+    case 3:
+      return fixed_context<3>(active_constraints, samples).solve();
+    case 4:
+      return fixed_context<4>(active_constraints, samples).solve();
+    }
 
-      
-      cout << "testing point ";
-      print_point(pt);
-      cout << endl;
+    return find_model();
+  }
 
-      for (auto con : active_constraints) {
-        value_constraint c = con.second;
-        linear_expression* expr = con.first;
-        linear_expression res = expr->evaluate_at(pt);
+  maybe<std::map<variable, rational> >
+  context::find_model() {
+    set<const linear_expression*> exprs;
+    for (const auto& constraint : active_constraints) {
+      exprs.insert(constraint.first);
+    }
 
-        cout << *expr << " evaluates to " << res << endl;
+    vector<const linear_expression*> constraint_exprs;
+    for (const auto& con : active_constraints) {
+      constraint_exprs.push_back(con.first);
+    }
 
-        assert(res.num_non_zero_coeffs() == 0);
+    // Lifting records every constraint's sign at each leaf
+    sign_invariant_partition sid =
+      build_partition(exprs, constraint_exprs);
+
+    vector<const test_pt*> pts = sid.test_point_refs();
+    int num_points = pts.size();
+    sign_vectors leaf_signs = sid.leaf_sign_vectors();
+
+    // Without variables nothing is lifted, evaluate at the single point
+    if (leaf_signs.num_vectors() != num_points) {
+      expression_matrix constraint_rows(constraint_exprs);
+      point_block block(next_var);
+      for (auto pt : pts) {
+        block.add_point(*pt);
+      }
 
-        if (c == EQUAL_ZERO) {
-          if (res.get_const().sign() == 0) {
-            
-          } else {
-            satisfies_all_constraints = false;
-            break;
-          }
-        } else {
-          assert(false);
+      vector<int> signs(constraint_rows.num_rows() * num_points);
+      evaluate_signs(constraint_rows, block, signs.data());
+
+      leaf_signs = sign_vectors(constraint_rows.num_rows());
+      for (int p = 0; p < num_points; p++) {
+        leaf_signs.add_vector();
+        for (int r = 0; r < constraint_rows.num_rows(); r++) {
+          leaf_signs.set(p, r, signs[r * num_points + p]);
         }
       }
+    }
 
-      if (satisfies_all_constraints) {
-        return maybe<test_pt>(pt);
-      }
+    int p = compile_constraints(active_constraints).first_match(leaf_signs);
+    if (p != -1) {
+      return maybe<test_pt>(*pts[p]);
     }
 
     return maybe<test_pt>();
@@ -2,7 +2,10 @@
 
 #include "algorithm.h"
 
+#include "expression_matrix.h"
 #include "rational.h"
+#include "sign_vector.h"
+#include "small_vector.h"
 
 using namespace dbhc;
 
@@ -10,133 +13,269 @@ namespace LinCAD {
 
   typedef int variable;
 
+  // Coefficients sorted by variable, expressions rarely mention more than
+  // a handful of variables so they are kept inline
+  typedef small_vector<std::pair<variable, rational>, 4> coeff_vector;
+
+  // An expression is stored as content * (sum coeffs[v]*v + c), where the
+  // coefficients and constant are integers with gcd 1 and content > 0.
+  // Arithmetic on expressions combines the integer parts with integer
+  // multipliers, so coefficient growth is bounded by the primitive form.
   class linear_expression {
-    std::map<variable, rational> coeffs;
+    coeff_vector coeffs;
     rational c;
+    rational content;
+
+    void normalize() {
+      remove_zero_coeffs();
+
+      if (content.sign() < 0) {
+        content.negate();
+        for (auto& cf : coeffs) {
+          cf.second.negate();
+        }
+        c.negate();
+      }
+
+      rational g = gcd(rational::zero(), c);
+      for (const auto& cf : coeffs) {
+        g = gcd(g, cf.second);
+      }
+
+      if (g.sign() == 0) {
+        content = rational::one();
+        return;
+      }
+
+      if (g != rational::one()) {
+        for (auto& cf : coeffs) {
+          cf.second /= g;
+        }
+        c /= g;
+        content *= g;
+      }
+    }
+
+    const std::pair<variable, rational>* find_cof(const variable var) const {
+      for (const auto& cf : coeffs) {
+        if (cf.first == var) {
+          return &cf;
+        }
+        if (cf.first > var) {
+          break;
+        }
+      }
+      return nullptr;
+    }
+
+    // coeffs_ must already be sorted by variable without duplicates
+    linear_expression(coeff_vector coeffs_,
+                      rational c_,
+                      rational content_,
+                      const bool) :
+      coeffs(std::move(coeffs_)), c(std::move(c_)), content(std::move(content_)) {
+      normalize();
+    }
 
   public:
 
     linear_expression(const std::vector<std::pair<variable, int> >& coeffs_,
-                      const int c_) : c(rational("0")) {
-      c = rational(std::to_string(c_));
-
-      coeffs = {};
+                      const int c_) : c(c_), content(1) {
+      coeffs.reserve(coeffs_.size());
       for (auto cf : coeffs_) {
-        coeffs.insert({cf.first, rational(std::to_string(cf.second))});
+        if (find_cof(cf.first) == nullptr) {
+          auto pos = begin(coeffs);
+          while (pos != end(coeffs) && pos->first < cf.first) {
+            ++pos;
+          }
+          coeffs.insert(pos, {cf.first, rational(cf.second)});
+        }
       }
 
-      remove_zero_coeffs();
+      normalize();
     }
 
     linear_expression(const std::map<variable, rational>& coeffs_,
-                      const rational& c_) : coeffs(coeffs_), c(c_) {
-      remove_zero_coeffs();
+                      rational c_) :
+      c(std::move(c_)), content(1) {
+      coeffs.reserve(coeffs_.size());
+      for (const auto& cf : coeffs_) {
+        coeffs.push_back(cf);
+      }
+      normalize();
+    }
+
+    // content_ * (sum coeffs_[v]*v + c_), the arguments need not be
+    // integers or primitive
+    linear_expression(const std::map<variable, rational>& coeffs_,
+                      rational c_,
+                      rational content_) :
+      c(std::move(c_)), content(std::move(content_)) {
+      coeffs.reserve(coeffs_.size());
+      for (const auto& cf : coeffs_) {
+        coeffs.push_back(cf);
+      }
+      normalize();
+    }
+
+    static linear_expression
+    from_sorted(coeff_vector coeffs_, rational c_, rational content_) {
+      return linear_expression(std::move(coeffs_), std::move(c_),
+                               std::move(content_), true);
     }
 
     rational cof(const variable var) const {
-      if (!contains_key(var, coeffs)) {
-        return rational("0");
+      auto cf = find_cof(var);
+      if (cf == nullptr) {
+        return rational::zero();
       }
 
-      return map_find(var, coeffs);
+      return content * cf->second;
     }
 
-    linear_expression scalar_mul(const rational& r) const {
-      std::map<variable, rational> mul_coeffs;
-      for (auto cf : coeffs) {
-        mul_coeffs.insert({cf.first, cf.second*r});
+    const rational& integer_cof(const variable var) const {
+      auto cf = find_cof(var);
+      if (cf == nullptr) {
+        return rational::zero();
       }
-      return linear_expression(mul_coeffs, r*get_const());
 
+      return cf->second;
     }
 
-    linear_expression drop(const variable v) const {
-      std::map<variable, rational> dropped_coeffs = coeffs;
-      dropped_coeffs.erase(v);
-      return linear_expression(dropped_coeffs, get_const());
+    const rational& integer_const() const {
+      return c;
     }
 
-    linear_expression
-    evaluate_at(const std::map<variable, rational>& var_values) const;
-    
-    void remove_zero_coeffs() {
-      std::vector<variable> zero_vars;
-      for (auto cf : coeffs) {
-        if (cf.second.sign() == 0) {
-          zero_vars.push_back(cf.first);
+    const rational& get_content() const {
+      return content;
+    }
+
+    const coeff_vector& integer_coefficients() const {
+      return coeffs;
+    }
+
+    // True if destroying the expression frees memory, either big rationals
+    // or coefficients that no longer fit inline
+    bool owns_heap() const {
+      if (coeffs.spilled() || !c.is_small() || !content.is_small()) {
+        return true;
+      }
+      for (const auto& cf : coeffs) {
+        if (!cf.second.is_small()) {
+          return true;
         }
       }
+      return false;
+    }
 
-      for (auto v : zero_vars) {
-        coeffs.erase(v);
+    linear_expression scalar_mul(const rational& r) const {
+      if (r.sign() == 0) {
+        return linear_expression({}, rational::zero());
       }
-    }
 
-    rational get_const() const {
-      return c;
+      linear_expression res(*this);
+      res.content *= r;
+      if (res.content.sign() < 0) {
+        res.normalize();
+      }
+      return res;
     }
 
-    linear_expression subtract(const linear_expression& other) const {
-
-      std::map<variable, rational> sub_coeffs;
-      for (auto cf : coeffs) {
-        if (contains_key(cf.first, other.coeffs)) {
-          sub_coeffs.insert({cf.first, cf.second - map_find(cf.first, other.coeffs)});
-        } else {
-          sub_coeffs.insert(cf);
+    linear_expression drop(const variable v) const {
+      coeff_vector dropped_coeffs;
+      dropped_coeffs.reserve(coeffs.size());
+      for (const auto& cf : coeffs) {
+        if (cf.first != v) {
+          dropped_coeffs.push_back(cf);
         }
       }
+      return from_sorted(std::move(dropped_coeffs), c, content);
+    }
+
+    linear_expression
+    evaluate_at(const std::map<variable, rational>& var_values) const;
+
+    // Sign of the expression at a point that assigns all of its variables,
+    // decided with interval arithmetic when the enclosure excludes zero
+    int sign_at(const std::map<variable, rational>& var_values) const;
 
-      for (auto other_cf : other.coeffs) {
-        if (!contains_key(other_cf.first, this->coeffs)) {
-          sub_coeffs.insert({other_cf.first, -other_cf.second});
+    void remove_zero_coeffs() {
+      auto last = begin(coeffs);
+      for (auto& cf : coeffs) {
+        if (cf.second.sign() != 0) {
+          if (&cf != last) {
+            *last = std::move(cf);
+          }
+          ++last;
         }
       }
+      coeffs.truncate(last - begin(coeffs));
+    }
 
-      rational cs = get_const() - other.get_const();
+    rational get_const() const {
+      return content * c;
+    }
 
-      return linear_expression(sub_coeffs, cs);
+    // sa*this + sb*other
+    linear_expression combine(const rational& sa,
+                              const linear_expression& other,
+                              const rational& sb) const;
+
+    linear_expression subtract(const linear_expression& other) const {
+      return combine(rational::one(), other, rational::minus_one());
     }
 
     bool equals(const linear_expression& other) const {
-      if (c != other.c) {
+      if (coeffs.size() != other.coeffs.size() ||
+          c != other.c ||
+          content != other.content) {
         return false;
       }
 
-      for (auto cf : coeffs) {
-        variable v = cf.first;
-        if (!contains_key(v, other.coeffs)) {
+      for (int i = 0; i < coeffs.size(); i++) {
+        if (coeffs[i].first != other.coeffs[i].first ||
+            coeffs[i].second != other.coeffs[i].second) {
           return false;
-        } else {
-          if (cf.second != map_find(v, other.coeffs)) {
-            return false;
-          }
         }
       }
 
       return true;
     }
 
+    size_t hash() const {
+      std::hash<rational> hash_rational;
+      size_t h = hash_rational(content);
+      h ^= hash_rational(c) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      for (const auto& cf : coeffs) {
+        h ^= ((size_t) cf.first) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        h ^= hash_rational(cf.second) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      }
+      return h;
+    }
+
     int num_non_zero_coeffs() const {
       return coeffs.size();
     }
 
     rational get_only_non_zero_coeff() const {
       assert(coeffs.size() == 1);
-      return begin(coeffs)->second;
+      return content * coeffs[0].second;
     }
 
     std::map<variable, rational> coefficient_map() const {
-      return coeffs;
+      std::map<variable, rational> true_coeffs;
+      for (const auto& cf : coeffs) {
+        true_coeffs.emplace_hint(end(true_coeffs), cf.first, content * cf.second);
+      }
+      return true_coeffs;
     }
   };
 
   static inline
   std::ostream&
   operator<<(std::ostream& out, const linear_expression& l) {
-    // TODO: Fill in coeffs
-    for (auto c : l.coefficient_map()) {
-      out << c.second << " * $v" << c.first << " + ";
+    for (const auto& c : l.integer_coefficients()) {
+      out << l.get_content() * c.second << " * $v" << c.first << " + ";
     }
 
     out << l.get_const();
@@ -148,9 +287,73 @@ namespace LinCAD {
     return x.equals(y);
   }
 
+  struct linear_expression_ptr_hash {
+    size_t operator()(const linear_expression* l) const { return l->hash(); }
+  };
+
+  struct linear_expression_ptr_equal {
+    bool operator()(const linear_expression* l, const linear_expression* r) const {
+      return l->equals(*r);
+    }
+  };
+
   linear_expression evaluate_at(const linear_expression& l,
                                 const std::map<variable, rational>& var_values);
 
+  // Bump allocator for the expressions owned by a context. Expressions are
+  // placed one after another in fixed size chunks, and only those that
+  // own heap memory are destroyed one by one when the arena goes away, the
+  // rest are released with their chunk. Expressions are handed out const,
+  // so whether one owns heap memory never changes after it is placed.
+  class expression_arena {
+    static const int chunk_exprs = 256;
+
+    std::vector<linear_expression*> chunks;
+    int used_in_chunk;
+    int num_exprs;
+    std::vector<const linear_expression*> owning_heap;
+
+  public:
+
+    expression_arena() : used_in_chunk(chunk_exprs), num_exprs(0) {}
+
+    expression_arena(const expression_arena&) = delete;
+    expression_arena& operator=(const expression_arena&) = delete;
+
+    const linear_expression* make(linear_expression&& l) {
+      if (used_in_chunk == chunk_exprs) {
+        chunks.push_back(static_cast<linear_expression*>
+                         (::operator new(chunk_exprs * sizeof(linear_expression))));
+        used_in_chunk = 0;
+      }
+
+      const linear_expression* expr =
+        new (chunks.back() + used_in_chunk) linear_expression(std::move(l));
+      used_in_chunk++;
+      num_exprs++;
+      if (expr->owns_heap()) {
+        owning_heap.push_back(expr);
+      }
+      return expr;
+    }
+
+    int size() const { return num_exprs; }
+
+    int num_chunks() const { return chunks.size(); }
+
+    // Expressions whose destructor still has to run on release
+    int num_owning_heap() const { return owning_heap.size(); }
+
+    ~expression_arena() {
+      for (auto expr : owning_heap) {
+        expr->~linear_expression();
+      }
+      for (auto chunk : chunks) {
+        ::operator delete(chunk);
+      }
+    }
+  };
+
   class cell {
 
     std::map<variable, rational> test_point;
@@ -158,8 +361,8 @@ namespace LinCAD {
     
   public:
 
-    cell(const std::map<variable, rational>& test_point_) :
-      test_point(test_point_) {}
+    cell(std::map<variable, rational> test_point_) :
+      test_point(std::move(test_point_)) {}
 
     int num_leaf_cells() const {
       if (children.size() == 0) {
@@ -174,23 +377,37 @@ namespace LinCAD {
       return total;
     }
 
-    cell* add_child(const std::map<variable, rational>& test_pt) {
-      cell* c = new cell(test_pt);
+    cell* add_child(std::map<variable, rational> test_pt) {
+      cell* c = new cell(std::move(test_pt));
       children.push_back(c);
 
       return c;
     }
 
-    std::vector<std::map<variable, rational> > test_points() const {
+    const std::map<variable, rational>& get_test_point() const {
+      return test_point;
+    }
+
+    // Calls f on the test point of every leaf below this cell, left to
+    // right, without copying them
+    template<typename F>
+    void visit_test_points(F& f) const {
       if (children.size() == 0) {
-        return {test_point};
+        f(test_point);
+        return;
       }
 
-      std::vector<std::map<variable, rational> > pts;
       for (auto c : children) {
-        auto tp = c->test_points();
-        concat(pts, tp);
+        c->visit_test_points(f);
       }
+    }
+
+    std::vector<std::map<variable, rational> > test_points() const {
+      std::vector<std::map<variable, rational> > pts;
+      auto collect = [&pts](const std::map<variable, rational>& pt) {
+        pts.push_back(pt);
+      };
+      visit_test_points(collect);
       return pts;
     }
 
@@ -204,15 +421,69 @@ namespace LinCAD {
   class sign_invariant_partition {
 
     cell root;
+
+    // Indexed by lifting depth, 0 is the first variable lifted
+    std::vector<long> sample_bits;
+    std::vector<long> num_samples;
+
+    size_t projection_footprint;
+
+    // Signs of the expressions the partition was built from at each leaf
+    // sample, in the order of test_points()
+    sign_vectors leaf_signs;
     
   public:
 
-    sign_invariant_partition() : root({}) {}
+    sign_invariant_partition() : root({}), projection_footprint(0) {}
+
+    void set_num_leaf_signs(const int n) {
+      leaf_signs = sign_vectors(n);
+    }
+
+    sign_vectors& get_leaf_signs() { return leaf_signs; }
+
+    const sign_vectors& leaf_sign_vectors() const { return leaf_signs; }
+
+    void set_projection_footprint(const size_t bytes) {
+      projection_footprint = bytes;
+    }
+
+    // Bytes held by all projection sets when the partition was built
+    size_t projection_footprint_bytes() const {
+      return projection_footprint;
+    }
+
+    void record_sample(const int depth, const rational& r) {
+      if (depth >= (int) sample_bits.size()) {
+        sample_bits.resize(depth + 1, 0);
+        num_samples.resize(depth + 1, 0);
+      }
+      sample_bits[depth] += r.bit_length();
+      num_samples[depth]++;
+    }
+
+    double average_sample_bits(const int depth) const {
+      if (depth >= (int) num_samples.size() || num_samples[depth] == 0) {
+        return 0;
+      }
+      return ((double) sample_bits[depth]) / num_samples[depth];
+    }
 
     std::vector<std::map<variable, rational> > test_points() const {
       return root.test_points();
     }
 
+    // Leaf test points in the order of test_points(), as references into
+    // the cell tree
+    std::vector<const std::map<variable, rational>*> test_point_refs() const {
+      std::vector<const std::map<variable, rational>*> pts;
+      auto collect = [&pts](const std::map<variable, rational>& pt) {
+        pts.push_back(&pt);
+      };
+      root.visit_test_points(collect);
+      return pts;
+    }
+
     cell* get_root_cell() { return &root; }
 
     int num_leaf_cells() const {
@@ -227,20 +498,106 @@ namespace LinCAD {
     GREATER_THAN_ZERO,
   };
 
-  typedef std::pair<linear_expression*, value_constraint> constraint;
+  typedef std::pair<const linear_expression*, value_constraint> constraint;
+
+  // Sign i of a packed vector must satisfy constraints[i]
+  sign_pattern compile_constraints(const std::vector<constraint>& constraints);
+
+  // How a sample is chosen in each cell of the lifting phase. Midpoints
+  // take (r_i + r_{i+1}) / 2 between roots and r -+ 1 outside them, the
+  // simplest sample is the rational with the smallest numerator and
+  // denominator in the cell, found on the Stern-Brocot tree.
+  enum sample_mode {
+    MIDPOINT_SAMPLES,
+    SIMPLEST_SAMPLES,
+  };
+
+  // Simplest rational in the open interval (a, b), a < b
+  rational simplest_between(const rational& a, const rational& b);
+
+  // Samples below, on and between the sorted roots and above them
+  std::vector<rational> build_test_points(const std::vector<rational>& sorted_roots,
+                                          const sample_mode mode);
+
+  // How project_away combines expressions. Dense rows give every variable
+  // a slot and run vector kernels, AUTO_ROWS uses them for problems with
+  // few variables whose expressions mention most of them.
+  enum coefficient_layout {
+    SPARSE_ROWS,
+    DENSE_ROWS,
+    AUTO_ROWS,
+  };
   
   class context {
-    std::set<linear_expression*> exprs;
+    // Hash-consed, so equal expressions added to a context share a pointer
+    std::unordered_set<const linear_expression*,
+                       linear_expression_ptr_hash,
+                       linear_expression_ptr_equal> exprs;
+
     std::map<int, std::string> var_names;
     variable next_var;
 
+    bool intern_rationals;
+    rational_table rational_constants;
+    bool record_provenance;
+
+    // After rational_constants, so expressions are destroyed before it
+    expression_arena expr_store;
+
+    sample_mode samples;
+    coefficient_layout layout;
+    bool fixed_dimensions;
+
     std::vector<constraint> active_constraints;
 
+    bool use_dense_rows(const int num_exprs, const int num_non_zeros) const;
+
+    // Records the signs of leaf_exprs at every leaf as it is lifted
+    sign_invariant_partition
+    build_partition(const std::set<const linear_expression*>& lin_exprs,
+                    const std::vector<const linear_expression*>& leaf_exprs);
+
+    maybe<std::map<variable, rational> >
+    find_model();
+
+    maybe<std::map<variable, rational> >
+    find_fixed_model();
+
   public:
 
-    context() : next_var(0) {}
+    context() : next_var(0), intern_rationals(false), record_provenance(false),
+                samples(SIMPLEST_SAMPLES), layout(AUTO_ROWS), fixed_dimensions(true) {}
+
+    void set_sample_mode(const sample_mode mode) {
+      samples = mode;
+    }
 
-    void add_constraint(linear_expression* const l,
+    void set_coefficient_layout(const coefficient_layout l) {
+      layout = l;
+    }
+
+    // Solve problems with 1 to 4 variables with fixed_context
+    void set_fixed_dimensions(const bool fixed) {
+      fixed_dimensions = fixed;
+    }
+
+    // Share one GMP value between equal big coefficients of the
+    // expressions built by project_away
+    void set_intern_rationals(const bool intern) {
+      intern_rationals = intern;
+    }
+
+    int num_interned_rationals() const {
+      return rational_constants.size();
+    }
+
+    // Keep the provenance of every row in the sets built by project, for
+    // evaluate_projection. The solver itself does not read it.
+    void set_record_provenance(const bool record) {
+      record_provenance = record;
+    }
+
+    void add_constraint(const linear_expression* const l,
                         const value_constraint c) {
       active_constraints.push_back({l, c});
     }
@@ -258,34 +615,59 @@ namespace LinCAD {
       return nv;
     }
 
-    linear_expression*
+    const linear_expression*
     add_linear_expression(const std::vector<std::pair<variable, int>>& coeffs, const int c) {
-      linear_expression* expr = new linear_expression(coeffs, c);
-      exprs.insert(expr);
-      return expr;
+      return add_linear_expression(linear_expression(coeffs, c));
     }
 
-    linear_expression*
+    const linear_expression*
     add_linear_expression(const linear_expression& l) {
-      linear_expression* expr = new linear_expression(l);
+      return add_linear_expression(linear_expression(l));
+    }
+
+    // Returns the stored expression equal to l if there is one
+    const linear_expression*
+    add_linear_expression(linear_expression&& l) {
+      auto it = exprs.find(&l);
+      if (it != end(exprs)) {
+        return *it;
+      }
+
+      const linear_expression* expr = expr_store.make(std::move(l));
       exprs.insert(expr);
       return expr;
     }
+
+    int num_linear_expressions() const {
+      return exprs.size();
+    }
+
+    const expression_arena& expression_storage() const {
+      return expr_store;
+    }
     
-    std::vector<linear_expression*>
-    project_away(const std::vector<linear_expression*>& exprs,
+    // Runs the projection over the canonical rows of exprs and stores the
+    // resulting rows as expressions of this context
+    std::vector<const linear_expression*>
+    project_away(const std::vector<const linear_expression*>& exprs,
+                 const variable var);
+
+    // Projection over canonical rows, the result is canonical and keeps
+    // each zero set once
+    expression_matrix
+    project_away(const expression_matrix& exprs,
                  const variable var);
 
+    // Projection sets eliminating variables 1, 2, ... in turn. Each level
+    // holds canonical rows without repeated zero sets or constants, and
+    // records the rows of the previous level each row came from.
+    std::vector<expression_matrix>
+    project(const std::set<const linear_expression*>& lin_exprs);
+
     sign_invariant_partition
-    build_sign_invariant_partition(const std::set<linear_expression*>& lin_exprs);
+    build_sign_invariant_partition(const std::set<const linear_expression*>& lin_exprs);
 
     maybe<std::map<variable, rational> >
     solve_constraints();
-
-    ~context() {
-      for (auto expr : exprs) {
-        delete expr;
-      }
-    }
   };
 }
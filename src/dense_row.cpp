@@ -0,0 +1,73 @@
+#include "dense_row.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINCAD_DENSE_AVX2 1
+#endif
+
+namespace LinCAD {
+
+  static void dense_combine_scalar(const int64_t* a, const int64_t ka,
+                                   const int64_t* b, const int64_t kb,
+                                   int64_t* out,
+                                   const int lanes) {
+    for (int i = 0; i < lanes; i++) {
+      out[i] = ka * a[i] + kb * b[i];
+    }
+  }
+
+#ifdef LINCAD_DENSE_AVX2
+
+  // _mm256_mul_epi32 multiplies the sign extended low halves of each lane,
+  // which is exact because every operand fits in int32
+  __attribute__((target("avx2")))
+  static void dense_combine_avx2(const int64_t* a, const int64_t ka,
+                                 const int64_t* b, const int64_t kb,
+                                 int64_t* out,
+                                 const int lanes) {
+    __m256i va_k = _mm256_set1_epi64x(ka);
+    __m256i vb_k = _mm256_set1_epi64x(kb);
+    for (int i = 0; i < lanes; i += 4) {
+      __m256i va = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+      __m256i vb = _mm256_load_si256(reinterpret_cast<const __m256i*>(b + i));
+      __m256i r = _mm256_add_epi64(_mm256_mul_epi32(va, va_k),
+                                   _mm256_mul_epi32(vb, vb_k));
+      _mm256_store_si256(reinterpret_cast<__m256i*>(out + i), r);
+    }
+  }
+
+  static bool detect_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+
+  bool dense_kernels_use_avx2() {
+    static const bool has_avx2 = detect_avx2();
+    return has_avx2;
+  }
+
+#else
+
+  bool dense_kernels_use_avx2() {
+    return false;
+  }
+
+#endif
+
+  void dense_combine(const dense_row& a, const int64_t ka,
+                     const dense_row& b, const int64_t kb,
+                     dense_row& out,
+                     const int width) {
+    int lanes = dense_lanes(width);
+
+#ifdef LINCAD_DENSE_AVX2
+    if (dense_kernels_use_avx2()) {
+      dense_combine_avx2(a.slots, ka, b.slots, kb, out.slots, lanes);
+      return;
+    }
+#endif
+
+    dense_combine_scalar(a.slots, ka, b.slots, kb, out.slots, lanes);
+  }
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+namespace LinCAD {
+
+  // Slots in a dense row, one per variable plus one for the constant
+  static const int dense_row_width = 16;
+
+  // Coefficients of a low-dimensional expression, indexed by variable with
+  // the constant in the last used slot. Every slot holds a value strictly
+  // inside the int32 range, so products of two slots and sums of two such
+  // products cannot overflow int64.
+  struct alignas(32) dense_row {
+    int64_t slots[dense_row_width];
+  };
+
+  static inline bool fits_dense_slot(const int64_t v) {
+    return v > INT32_MIN && v <= INT32_MAX;
+  }
+
+  // Rounds a width up to the four lanes of one AVX2 register
+  static inline int dense_lanes(const int width) {
+    return (width + 3) & ~3;
+  }
+
+  // out[i] = ka * a[i] + kb * b[i] for i < dense_lanes(width). ka, kb and
+  // the slots of a and b must satisfy fits_dense_slot.
+  void dense_combine(const dense_row& a, const int64_t ka,
+                     const dense_row& b, const int64_t kb,
+                     dense_row& out,
+                     const int width);
+
+  // True when dense_combine runs the AVX2 kernel on this machine
+  bool dense_kernels_use_avx2();
+
+}
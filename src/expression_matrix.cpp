@@ -0,0 +1,489 @@
+#include "expression_matrix.h"
+
+#include "context.h"
+
+#include <cassert>
+
+using namespace std;
+
+namespace LinCAD {
+
+  expression_matrix::expression_matrix(const std::vector<const linear_expression*>& exprs) :
+    row_start{0}, keep_provenance(false) {
+    for (auto expr : exprs) {
+      add_row(*expr);
+    }
+  }
+
+  void expression_matrix::add_row(const linear_expression& l) {
+    assert(row_hashes.empty());
+
+    for (const auto& cf : l.integer_coefficients()) {
+      vars.push_back(cf.first);
+      coeffs.push_back(cf.second);
+    }
+    finish_row(l.integer_const(), l.get_content());
+  }
+
+  void expression_matrix::finish_row(rational c, rational content) {
+    for (int k = row_start.back(); k < (int) vars.size(); k++) {
+      coeff_enclosures.push_back(to_interval(coeffs[k]));
+    }
+    row_start.push_back(vars.size());
+
+    const_enclosures.push_back(to_interval(c));
+    consts.push_back(std::move(c));
+    contents.push_back(std::move(content));
+    if (keep_provenance) {
+      provenance.push_back({-1, -1, rational::zero(), rational::zero()});
+    }
+  }
+
+  expression_matrix expression_matrix::solved_for(const variable var) const {
+    expression_matrix solved;
+    for (int r = 0; r < num_rows(); r++) {
+      const rational& a = row_cof(r, var);
+      if (a.sign() == 0) {
+        continue;
+      }
+
+      rational scale = rational::minus_one() / a;
+      for (int k = row_begin(r); k < row_end(r); k++) {
+        if (vars[k] != var) {
+          solved.vars.push_back(vars[k]);
+          solved.coeffs.push_back(coeffs[k] * scale);
+        }
+      }
+      solved.finish_row(consts[r] * scale, rational::one());
+    }
+    return solved;
+  }
+
+  void expression_matrix::add_canonical_row(const linear_expression& l) {
+    for (const auto& cf : l.integer_coefficients()) {
+      vars.push_back(cf.first);
+      coeffs.push_back(cf.second);
+    }
+    finish_canonical_row(l.integer_const(), nullptr,
+                         {-1, -1, rational::zero(), rational::zero()});
+  }
+
+  void expression_matrix::add_canonical_row(const expression_matrix& src,
+                                            const int r) {
+    for (int k = src.row_begin(r); k < src.row_end(r); k++) {
+      vars.push_back(src.vars[k]);
+      coeffs.push_back(src.coeffs[k]);
+    }
+    finish_canonical_row(src.consts[r], nullptr,
+                         {r, -1, rational::one(), rational::zero()});
+  }
+
+  bool expression_matrix::load_dense(const int r,
+                                     dense_row& row,
+                                     const int width) const {
+    for (int i = 0; i < dense_row_width; i++) {
+      row.slots[i] = 0;
+    }
+
+    int64_t v;
+    for (int k = row_begin(r); k < row_end(r); k++) {
+      if (vars[k] >= width - 1 ||
+          !coeffs[k].small_integer(v) ||
+          !fits_dense_slot(v)) {
+        return false;
+      }
+      row.slots[vars[k]] = v;
+    }
+
+    if (!consts[r].small_integer(v) || !fits_dense_slot(v)) {
+      return false;
+    }
+    row.slots[width - 1] = v;
+    return true;
+  }
+
+  void expression_matrix::add_canonical_elimination(const expression_matrix& src,
+                                                    const int a,
+                                                    const int b,
+                                                    const variable var,
+                                                    const int dense_width,
+                                                    rational_table* table) {
+    // Contents only scale the result, which is made primitive anyway
+    rational ka = src.row_cof(b, var);
+    rational kb = src.row_cof(a, var);
+    kb.negate();
+    rational g = gcd(ka, kb);
+    if (g.sign() == 0) {
+      return;
+    }
+
+    ka /= g;
+    kb /= g;
+
+    int64_t ka_i;
+    int64_t kb_i;
+    dense_row da;
+    dense_row db;
+    if (dense_width > 0 &&
+        ka.small_integer(ka_i) && fits_dense_slot(ka_i) &&
+        kb.small_integer(kb_i) && fits_dense_slot(kb_i) &&
+        src.load_dense(a, da, dense_width) &&
+        src.load_dense(b, db, dense_width)) {
+      dense_row res;
+      dense_combine(da, ka_i, db, kb_i, res, dense_width);
+
+      for (int v = 0; v < dense_width - 1; v++) {
+        if (v != var && res.slots[v] != 0) {
+          vars.push_back(v);
+          coeffs.push_back(rational(res.slots[v]));
+        }
+      }
+      finish_canonical_row(rational(res.slots[dense_width - 1]), table,
+                           {a, b, std::move(ka), std::move(kb)});
+      return;
+    }
+
+    int ai = src.row_begin(a);
+    int bi = src.row_begin(b);
+    int a_end = src.row_end(a);
+    int b_end = src.row_end(b);
+    while (ai != a_end || bi != b_end) {
+      if (bi == b_end || (ai != a_end && src.vars[ai] < src.vars[bi])) {
+        if (src.vars[ai] != var) {
+          vars.push_back(src.vars[ai]);
+          coeffs.push_back(src.coeffs[ai] * ka);
+        }
+        ++ai;
+      } else if (ai == a_end || src.vars[bi] < src.vars[ai]) {
+        if (src.vars[bi] != var) {
+          vars.push_back(src.vars[bi]);
+          coeffs.push_back(src.coeffs[bi] * kb);
+        }
+        ++bi;
+      } else {
+        if (src.vars[ai] != var) {
+          rational v = src.coeffs[ai] * ka;
+          v.addmul(src.coeffs[bi], kb);
+          vars.push_back(src.vars[ai]);
+          coeffs.push_back(std::move(v));
+        }
+        ++ai;
+        ++bi;
+      }
+    }
+
+    rational c = src.consts[a] * ka;
+    c.addmul(src.consts[b], kb);
+    finish_canonical_row(std::move(c), table, {a, b, std::move(ka), std::move(kb)});
+  }
+
+  void expression_matrix::finish_canonical_row(rational c,
+                                               rational_table* table,
+                                               row_provenance prov) {
+    int start = row_start.back();
+
+    int last = start;
+    for (int k = start; k < (int) vars.size(); k++) {
+      if (coeffs[k].sign() != 0) {
+        if (k != last) {
+          vars[last] = vars[k];
+          coeffs[last] = std::move(coeffs[k]);
+        }
+        last++;
+      }
+    }
+    vars.resize(last);
+    coeffs.resize(last);
+
+    // Constant rows have no roots
+    if (last == start) {
+      return;
+    }
+
+    rational g = gcd(rational::zero(), c);
+    for (int k = start; k < last; k++) {
+      g = gcd(g, coeffs[k]);
+    }
+    if (coeffs[start].sign() < 0) {
+      g.negate();
+    }
+    if (g != rational::one()) {
+      for (int k = start; k < last; k++) {
+        coeffs[k] /= g;
+      }
+      c /= g;
+      if (keep_provenance) {
+        prov.ka /= g;
+        prov.kb /= g;
+      }
+    }
+
+    if (table != nullptr) {
+      for (int k = start; k < last; k++) {
+        table->intern(coeffs[k]);
+      }
+      table->intern(c);
+    }
+
+    finish_row(std::move(c), rational::one());
+    if (keep_provenance) {
+      provenance.back() = std::move(prov);
+    }
+
+    int r = num_rows() - 1;
+    assert(((int) row_hashes.size()) == r);
+    size_t h = row_hash(r);
+    if (find_row(*this, r, h) != -1) {
+      vars.resize(start);
+      coeffs.resize(start);
+      coeff_enclosures.resize(start);
+      row_start.pop_back();
+      consts.pop_back();
+      const_enclosures.pop_back();
+      contents.pop_back();
+      if (keep_provenance) {
+        provenance.pop_back();
+      }
+      return;
+    }
+
+    row_hashes.push_back(h);
+    if (2 * row_hashes.size() > row_slots.size()) {
+      row_slots.assign(row_slots.size() == 0 ? 16 : 2 * row_slots.size(), -1);
+      for (int s = 0; s < (int) row_hashes.size(); s++) {
+        insert_row_slot(s);
+      }
+    } else {
+      insert_row_slot(r);
+    }
+  }
+
+  void expression_matrix::insert_row_slot(const int r) {
+    size_t mask = row_slots.size() - 1;
+    size_t i = row_hashes[r] & mask;
+    while (row_slots[i] != -1) {
+      i = (i + 1) & mask;
+    }
+    row_slots[i] = r;
+  }
+
+  size_t expression_matrix::row_hash(const int r) const {
+    std::hash<rational> hash_rational;
+    size_t h = hash_rational(consts[r]);
+    for (int k = row_begin(r); k < row_end(r); k++) {
+      h ^= ((size_t) vars[k]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      h ^= hash_rational(coeffs[k]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    }
+    return h;
+  }
+
+  int expression_matrix::find_row(const expression_matrix& src,
+                                   const int s,
+                                   const size_t h) const {
+    if (row_slots.size() == 0) {
+      return -1;
+    }
+
+    size_t mask = row_slots.size() - 1;
+    for (size_t i = h & mask; row_slots[i] != -1; i = (i + 1) & mask) {
+      int r = row_slots[i];
+      if (row_hashes[r] == h && rows_equal(r, src, s)) {
+        return r;
+      }
+    }
+    return -1;
+  }
+
+  int expression_matrix::find_canonical_row(const linear_expression& l) const {
+    expression_matrix probe;
+    probe.add_canonical_row(l);
+    if (probe.num_rows() == 0) {
+      return -1;
+    }
+    return find_row(probe, 0, probe.row_hashes[0]);
+  }
+
+  bool expression_matrix::rows_equal(const int r,
+                                     const expression_matrix& src,
+                                     const int s) const {
+    if (row_end(r) - row_begin(r) != src.row_end(s) - src.row_begin(s) ||
+        consts[r] != src.consts[s] ||
+        contents[r] != src.contents[s]) {
+      return false;
+    }
+
+    for (int i = 0; i < row_end(r) - row_begin(r); i++) {
+      int kr = row_begin(r) + i;
+      int ks = src.row_begin(s) + i;
+      if (vars[kr] != src.vars[ks] || coeffs[kr] != src.coeffs[ks]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  linear_expression expression_matrix::row_expression(const int r) const {
+    coeff_vector row_coeffs;
+    row_coeffs.reserve(row_end(r) - row_begin(r));
+    for (int k = row_begin(r); k < row_end(r); k++) {
+      row_coeffs.emplace_back(vars[k], coeffs[k]);
+    }
+    return linear_expression::from_sorted(std::move(row_coeffs), consts[r], contents[r]);
+  }
+
+  const rational& expression_matrix::row_cof(const int r, const variable var) const {
+    for (int k = row_begin(r); k < row_end(r); k++) {
+      if (vars[k] == var) {
+        return coeffs[k];
+      }
+      if (vars[k] > var) {
+        break;
+      }
+    }
+    return rational::zero();
+  }
+
+  size_t expression_matrix::footprint_bytes() const {
+    size_t bytes = sizeof(*this) +
+      row_start.capacity() * sizeof(int) +
+      vars.capacity() * sizeof(variable) +
+      coeffs.capacity() * sizeof(rational) +
+      coeff_enclosures.capacity() * sizeof(interval) +
+      consts.capacity() * sizeof(rational) +
+      const_enclosures.capacity() * sizeof(interval) +
+      contents.capacity() * sizeof(rational) +
+      provenance.capacity() * sizeof(row_provenance) +
+      row_hashes.capacity() * sizeof(size_t) +
+      row_slots.capacity() * sizeof(int);
+
+    for (const auto& c : coeffs) {
+      bytes += c.heap_bytes();
+    }
+    for (int r = 0; r < num_rows(); r++) {
+      bytes += consts[r].heap_bytes() + contents[r].heap_bytes();
+    }
+    for (const auto& prov : provenance) {
+      bytes += prov.ka.heap_bytes() + prov.kb.heap_bytes();
+    }
+    return bytes;
+  }
+
+  void expression_matrix::print(std::ostream& out) const {
+    for (int r = 0; r < num_rows(); r++) {
+      out << "\t\t";
+      for (int k = row_begin(r); k < row_end(r); k++) {
+        out << contents[r] * coeffs[k] << " * $v" << vars[k] << " + ";
+      }
+      out << contents[r] * consts[r] << std::endl;
+    }
+  }
+
+  void evaluate_projection(const std::vector<expression_matrix>& levels,
+                           const std::map<variable, rational>& pt,
+                           std::vector<std::vector<rational> >& values) {
+    values.resize(levels.size());
+    for (int l = 0; l < (int) levels.size(); l++) {
+      const expression_matrix& m = levels[l];
+      values[l].resize(m.num_rows());
+
+      for (int r = 0; r < m.num_rows(); r++) {
+        const row_provenance& src = m.row_source(r);
+        rational& val = values[l][r];
+
+        if (src.a == -1) {
+          assert(l == 0);
+          val = m.row_const(r);
+          for (int k = m.row_begin(r); k < m.row_end(r); k++) {
+            const rational* x = find_value(m.entry_var(k), pt);
+            assert(x != nullptr);
+            val.addmul(*x, m.entry_coeff(k));
+          }
+          continue;
+        }
+
+        const vector<rational>& parents = values[l - 1];
+        val = parents[src.a];
+        val *= src.ka;
+        if (src.b != -1) {
+          val.addmul(parents[src.b], src.kb);
+        }
+      }
+    }
+  }
+
+  void point_block::add_point(const std::map<variable, rational>& pt) {
+    num_pts++;
+    int start = values.size();
+    values.resize(start + num_vars);
+    enclosures.resize(start + num_vars);
+    for (const auto& val : pt) {
+      if (val.first < num_vars) {
+        values[start + val.first] = val.second;
+        enclosures[start + val.first] = to_interval(val.second);
+      }
+    }
+  }
+
+  void evaluate_signs(const expression_matrix& m,
+                      const point_block& pts,
+                      int* signs) {
+    int num_points = pts.num_points();
+    rational exact;
+    for (int r = 0; r < m.num_rows(); r++) {
+      int row_begin = m.row_start[r];
+      int row_end = m.row_start[r + 1];
+
+      for (int p = 0; p < num_points; p++) {
+        const rational* vals = pts.values.data() + p * pts.num_vars;
+        const interval* encs = pts.enclosures.data() + p * pts.num_vars;
+
+        // Contents are positive, so the sign is that of the integer part
+        interval acc = m.const_enclosures[r];
+        for (int k = row_begin; k < row_end; k++) {
+          assert(m.vars[k] < pts.num_vars);
+          acc = acc + m.coeff_enclosures[k] * encs[m.vars[k]];
+        }
+
+        int* out = signs + r * num_points + p;
+        if (acc.excludes_zero()) {
+          record_filter_hit();
+          *out = acc.sign();
+          continue;
+        }
+
+        record_filter_miss();
+        exact = m.consts[r];
+        for (int k = row_begin; k < row_end; k++) {
+          exact.addmul(vals[m.vars[k]], m.coeffs[k]);
+        }
+        *out = exact.sign();
+      }
+    }
+  }
+
+  void evaluate_values(const expression_matrix& m,
+                       const point_block& pts,
+                       rational* values) {
+    int num_points = pts.num_points();
+    for (int r = 0; r < m.num_rows(); r++) {
+      int row_begin = m.row_start[r];
+      int row_end = m.row_start[r + 1];
+      bool scaled = m.contents[r] != rational::one();
+
+      for (int p = 0; p < num_points; p++) {
+        const rational* vals = pts.values.data() + p * pts.num_vars;
+
+        rational& out = values[r * num_points + p];
+        out = m.consts[r];
+        for (int k = row_begin; k < row_end; k++) {
+          assert(m.vars[k] < pts.num_vars);
+          out.addmul(vals[m.vars[k]], m.coeffs[k]);
+        }
+        if (scaled) {
+          out *= m.contents[r];
+        }
+      }
+    }
+  }
+
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cassert>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "dense_row.h"
+#include "filter.h"
+#include "rational.h"
+
+namespace LinCAD {
+
+  typedef int variable;
+
+  class linear_expression;
+  class point_block;
+
+  // Where a projected row came from: row = ka * a + kb * b over rows a
+  // and b of the previous level, or a copy of a when b is -1. Rows that
+  // were not projected have a = -1.
+  struct row_provenance {
+    int a;
+    int b;
+    rational ka;
+    rational kb;
+  };
+
+  // Rows of linear expressions in compressed sparse row form. Row r keeps
+  // its primitive integer coefficients in vars and coeffs at
+  // [row_start[r], row_start[r + 1]), its integer constant in consts[r]
+  // and its content in contents[r], along with interval enclosures of the
+  // coefficients and constant for filtered evaluation.
+  //
+  // Projection sets only use rows in canonical form, content 1 and a
+  // positive leading coefficient, and keep each such row once. A matrix
+  // holds either canonical rows or rows added with add_row.
+  class expression_matrix {
+    std::vector<int> row_start;
+    std::vector<variable> vars;
+    std::vector<rational> coeffs;
+    std::vector<interval> coeff_enclosures;
+    std::vector<rational> consts;
+    std::vector<interval> const_enclosures;
+    std::vector<rational> contents;
+
+    // Only filled when keep_provenance is set
+    bool keep_provenance;
+    std::vector<row_provenance> provenance;
+
+    // Open addressed index of the canonical rows, -1 marks a free slot
+    std::vector<size_t> row_hashes;
+    std::vector<int> row_slots;
+
+    bool load_dense(const int r, dense_row& row, const int width) const;
+
+    size_t row_hash(const int r) const;
+    // Row r of this matrix equals row s of src
+    bool rows_equal(const int r, const expression_matrix& src, const int s) const;
+    // Index of the row equal to row s of src whose hash is h, or -1
+    int find_row(const expression_matrix& src, const int s, const size_t h) const;
+    void insert_row_slot(const int r);
+
+    // Complete the row whose entries were pushed after row_start.back()
+    void finish_row(rational c, rational content);
+    void finish_canonical_row(rational c, rational_table* table, row_provenance prov);
+
+  public:
+
+    expression_matrix() : row_start{0}, keep_provenance(false) {}
+
+    explicit expression_matrix(const std::vector<const linear_expression*>& exprs);
+
+    void add_row(const linear_expression& l);
+
+    // Appends the canonical form of l, see linear_expression::canonical.
+    // Constant expressions and rows already present are skipped.
+    void add_canonical_row(const linear_expression& l);
+
+    // add_canonical_row for row r of src
+    void add_canonical_row(const expression_matrix& src, const int r);
+
+    // Appends the canonical form of cof(var, b) * a - cof(var, a) * b for
+    // rows a and b of src, as add_canonical_row does. A nonzero
+    // dense_width runs the dense kernel over rows of that width, and big
+    // values are interned in table when it is given.
+    void add_canonical_elimination(const expression_matrix& src,
+                                   const int a,
+                                   const int b,
+                                   const variable var,
+                                   const int dense_width,
+                                   rational_table* table);
+
+    // Rows that give the root in var of each row that mentions it, as an
+    // affine function -(c + sum a_j x_j) / a_var of the other variables
+    expression_matrix solved_for(const variable var) const;
+
+    int num_rows() const { return consts.size(); }
+
+    int num_non_zeros() const { return vars.size(); }
+
+    int row_begin(const int r) const { return row_start[r]; }
+    int row_end(const int r) const { return row_start[r + 1]; }
+
+    variable entry_var(const int k) const { return vars[k]; }
+    const rational& entry_coeff(const int k) const { return coeffs[k]; }
+
+    const rational& row_const(const int r) const { return consts[r]; }
+    const rational& row_content(const int r) const { return contents[r]; }
+
+    const rational& row_cof(const int r, const variable var) const;
+
+    // Index of the row holding the canonical form of l, or -1
+    int find_canonical_row(const linear_expression& l) const;
+
+    linear_expression row_expression(const int r) const;
+
+    // Records the source of every row added from now on, the matrix must
+    // still be empty
+    void record_provenance() {
+      assert(num_rows() == 0);
+      keep_provenance = true;
+    }
+
+    bool has_provenance() const { return keep_provenance; }
+
+    const row_provenance& row_source(const int r) const {
+      assert(keep_provenance);
+      return provenance[r];
+    }
+
+    // Bytes held by the matrix, including the heap values of big entries
+    size_t footprint_bytes() const;
+
+    void print(std::ostream& out) const;
+
+    friend void evaluate_signs(const expression_matrix& m,
+                               const point_block& pts,
+                               int* signs);
+
+    friend void evaluate_values(const expression_matrix& m,
+                                const point_block& pts,
+                                rational* values);
+  };
+
+  // Values at pt of every row of levels, where each level after the first
+  // was projected from the one before it and every level records its
+  // provenance, see context::set_record_provenance. Rows of the first
+  // level are evaluated directly and every later row from the values of
+  // the rows it came from, so each coefficient is read once.
+  void evaluate_projection(const std::vector<expression_matrix>& levels,
+                           const std::map<variable, rational>& pt,
+                           std::vector<std::vector<rational> >& values);
+
+  // Sample points stored point after point, each as a dense column of
+  // values indexed by variable with their interval enclosures
+  class point_block {
+    int num_vars;
+    int num_pts;
+    std::vector<rational> values;
+    std::vector<interval> enclosures;
+
+  public:
+
+    point_block(const int num_vars_) : num_vars(num_vars_), num_pts(0) {}
+
+    // pt must assign every variable below num_vars
+    void add_point(const std::map<variable, rational>& pt);
+
+    int num_points() const { return num_pts; }
+
+    friend void evaluate_signs(const expression_matrix& m,
+                               const point_block& pts,
+                               int* signs);
+
+    friend void evaluate_values(const expression_matrix& m,
+                                const point_block& pts,
+                                rational* values);
+  };
+
+  // Writes the sign of row r at point p into signs[r * pts.num_points() + p].
+  // Each sign is decided on intervals when the enclosure excludes zero and
+  // with exact arithmetic otherwise. signs must hold num_rows() *
+  // num_points() entries, nothing is allocated per entry.
+  void evaluate_signs(const expression_matrix& m,
+                      const point_block& pts,
+                      int* signs);
+
+  // Writes the exact value of row r at point p, content included, into
+  // values[r * pts.num_points() + p]. values must hold num_rows() *
+  // num_points() entries, they are assigned in place so a buffer reused
+  // across calls keeps its storage.
+  void evaluate_values(const expression_matrix& m,
+                       const point_block& pts,
+                       rational* values);
+
+}
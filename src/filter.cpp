@@ -0,0 +1,155 @@
+#include "filter.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace LinCAD {
+
+  static thread_local filter_stats stats = {0, 0};
+
+  filter_stats filter_statistics() {
+    return stats;
+  }
+
+  void reset_filter_statistics() {
+    stats.hits = 0;
+    stats.misses = 0;
+  }
+
+  void record_filter_hit() {
+    stats.hits++;
+  }
+
+  void record_filter_miss() {
+    stats.misses++;
+  }
+
+  int filtered_compare(const rational& l, const interval& li,
+                       const rational& r, const interval& ri) {
+    if (li.hi < ri.lo) {
+      record_filter_hit();
+      return -1;
+    }
+
+    if (ri.hi < li.lo) {
+      record_filter_hit();
+      return 1;
+    }
+
+    record_filter_miss();
+    return l.compare(r);
+  }
+
+  std::vector<rational> filtered_sort_unique(const std::vector<rational>& elems) {
+    vector<pair<interval, rational> > keyed;
+    keyed.reserve(elems.size());
+    for (const auto& e : elems) {
+      keyed.push_back({to_interval(e), e});
+    }
+
+    sort(begin(keyed), end(keyed),
+         [](const pair<interval, rational>& l, const pair<interval, rational>& r) {
+           return filtered_compare(l.second, l.first, r.second, r.first) < 0;
+         });
+
+    vector<rational> sorted;
+    sorted.reserve(keyed.size());
+    interval last;
+    for (auto& k : keyed) {
+      if (sorted.empty() ||
+          filtered_compare(sorted.back(), last, k.second, k.first) != 0) {
+        last = k.first;
+        sorted.push_back(std::move(k.second));
+      }
+    }
+    return sorted;
+  }
+
+  // Common denominator of the inline roots with the numerators over it
+  // as order preserving unsigned keys. Fails if anything leaves int64.
+  static bool common_denominator_keys(const std::vector<rational>& roots,
+                                      int64_t& common,
+                                      std::vector<uint64_t>& keys) {
+    int64_t n = 0;
+    int64_t d = 1;
+    common = 1;
+    for (const auto& r : roots) {
+      if (!r.small_fraction(n, d) ||
+          __builtin_mul_overflow(common / gcd64(common, d), d, &common)) {
+        return false;
+      }
+    }
+
+    keys.resize(roots.size());
+    for (int i = 0; i < (int) roots.size(); i++) {
+      roots[i].small_fraction(n, d);
+      int64_t key;
+      if (__builtin_mul_overflow(n, common / d, &key) || key == INT64_MIN) {
+        return false;
+      }
+      keys[i] = ((uint64_t) key) ^ (((uint64_t) 1) << 63);
+    }
+    return true;
+  }
+
+  static void radix_sort(std::vector<uint64_t>& keys, std::vector<uint64_t>& tmp) {
+    tmp.resize(keys.size());
+    for (int shift = 0; shift < 64; shift += 8) {
+      int counts[257] = {0};
+      for (auto k : keys) {
+        counts[((k >> shift) & 0xff) + 1]++;
+      }
+
+      // Every key has the same byte here
+      if (counts[((keys[0] >> shift) & 0xff) + 1] == (int) keys.size()) {
+        continue;
+      }
+
+      for (int b = 0; b < 256; b++) {
+        counts[b + 1] += counts[b];
+      }
+      for (auto k : keys) {
+        tmp[counts[(k >> shift) & 0xff]++] = k;
+      }
+      keys.swap(tmp);
+    }
+  }
+
+  void sort_unique_roots(std::vector<rational>& roots, root_sort_buffer& buf) {
+    if (roots.size() < 2) {
+      return;
+    }
+
+    int64_t common;
+    if (common_denominator_keys(roots, common, buf.keys)) {
+      if (buf.keys.size() >= min_radix_sort_roots) {
+        radix_sort(buf.keys, buf.tmp);
+      } else {
+        sort(begin(buf.keys), end(buf.keys));
+      }
+
+      auto last = unique(begin(buf.keys), end(buf.keys));
+      roots.resize(last - begin(buf.keys));
+      for (int i = 0; i < (int) roots.size(); i++) {
+        int64_t key = (int64_t) (buf.keys[i] ^ (((uint64_t) 1) << 63));
+        roots[i] = rational(key, common);
+      }
+      return;
+    }
+
+    for (const auto& r : roots) {
+      if (!r.is_small()) {
+        roots = filtered_sort_unique(roots);
+        return;
+      }
+    }
+
+    sort(begin(roots), end(roots),
+         [](const rational& l, const rational& r) { return l.compare(r) < 0; });
+    roots.erase(unique(begin(roots), end(roots),
+                       [](const rational& l, const rational& r) { return l.equals(r); }),
+                end(roots));
+  }
+
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "rational.h"
+
+namespace LinCAD {
+
+  // Closed interval of doubles that contains the exact value it was
+  // computed from. Every bound is rounded outward after each operation,
+  // so the enclosure holds whatever the FPU rounding mode is.
+  struct interval {
+    double lo;
+    double hi;
+
+    interval() : lo(0), hi(0) {}
+
+    interval(const double lo_, const double hi_) : lo(lo_), hi(hi_) {}
+
+    bool excludes_zero() const {
+      return lo > 0 || hi < 0;
+    }
+
+    // Only meaningful when excludes_zero()
+    int sign() const {
+      return lo > 0 ? 1 : -1;
+    }
+  };
+
+  static inline double round_down(const double x) {
+    return std::nextafter(x, -std::numeric_limits<double>::infinity());
+  }
+
+  static inline double round_up(const double x) {
+    return std::nextafter(x, std::numeric_limits<double>::infinity());
+  }
+
+  // Moves x by ulps representable doubles away from zero on either side
+  static inline interval widen(const double x, const int ulps) {
+    double lo = x;
+    double hi = x;
+    for (int i = 0; i < ulps; i++) {
+      lo = round_down(lo);
+      hi = round_up(hi);
+    }
+    return interval(lo, hi);
+  }
+
+  static inline interval to_interval(const rational& r) {
+    static const int64_t exact_double_bound = ((int64_t) 1) << 53;
+
+    int64_t n = 0;
+    int64_t d = 1;
+    if (!r.small_fraction(n, d)) {
+      // mpq_get_d truncates, less than one ulp off
+      return widen(r.to_double(), 1);
+    }
+
+    // One correctly rounded division when both operands convert exactly,
+    // otherwise each conversion rounds as well
+    bool exact_operands = n >= -exact_double_bound && n <= exact_double_bound &&
+      d <= exact_double_bound;
+    return widen(r.to_double(), exact_operands ? 1 : 4);
+  }
+
+  static inline interval operator+(const interval& l, const interval& r) {
+    return interval(round_down(l.lo + r.lo), round_up(l.hi + r.hi));
+  }
+
+  static inline interval operator*(const interval& l, const interval& r) {
+    double a = l.lo * r.lo;
+    double b = l.lo * r.hi;
+    double c = l.hi * r.lo;
+    double d = l.hi * r.hi;
+
+    double lo = std::fmin(std::fmin(a, b), std::fmin(c, d));
+    double hi = std::fmax(std::fmax(a, b), std::fmax(c, d));
+    if (std::isnan(lo) || std::isnan(hi)) {
+      return interval(-std::numeric_limits<double>::infinity(),
+                      std::numeric_limits<double>::infinity());
+    }
+    return interval(round_down(lo), round_up(hi));
+  }
+
+  struct filter_stats {
+    unsigned long hits;
+    unsigned long misses;
+  };
+
+  // Per-thread counts of decisions made on intervals (hits) and of
+  // decisions that needed exact arithmetic (misses)
+  filter_stats filter_statistics();
+  void reset_filter_statistics();
+
+  void record_filter_hit();
+  void record_filter_miss();
+
+  // Exact three way comparison of l and r, li and ri enclose them
+  int filtered_compare(const rational& l, const interval& li,
+                       const rational& r, const interval& ri);
+
+  // Sorted distinct copy of elems, ordered on enclosures where they are
+  // disjoint
+  std::vector<rational> filtered_sort_unique(const std::vector<rational>& elems);
+
+  // Scratch space for sort_unique_roots, reused between calls
+  struct root_sort_buffer {
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> tmp;
+  };
+
+  // Below this many roots integer keys are sorted by comparison
+  static const int min_radix_sort_roots = 64;
+
+  // Sorts roots and removes repeats in place. When every root is inline
+  // and a common denominator fits in int64 the roots are ordered as int64
+  // numerators over it, radix sorted once there are enough of them.
+  // Otherwise inline roots are compared by 128 bit cross multiplication,
+  // and sets with big roots go through filtered_sort_unique.
+  void sort_unique_roots(std::vector<rational>& roots, root_sort_buffer& buf);
+
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <array>
+#include <type_traits>
+
+#include "context.h"
+
+namespace LinCAD {
+
+  // Solver for problems over exactly N variables. Expressions are arrays
+  // with one slot per variable and the constant last, and the projection
+  // and lifting levels are fixed at compile time, so lifting is a chain of
+  // N nested loops over samples that stops at the first satisfying leaf.
+  //
+  // Level L has eliminated variables N - L, ..., N - 1 and its roots are
+  // taken in variable N - 1 - L, so variables are lifted in order 0, 1,
+  // ..., N - 1.
+  template<int N>
+  class fixed_context {
+  public:
+
+    typedef std::array<rational, N + 1> fixed_expression;
+
+  private:
+
+    std::array<std::vector<fixed_expression>, N> levels;
+    std::vector<fixed_expression> constraint_exprs;
+    sign_pattern pattern;
+    sample_mode mode;
+
+    std::array<rational, N> pt;
+    std::array<std::vector<rational>, N> roots;
+    std::vector<uint64_t> leaf_words;
+    root_sort_buffer sort_buf;
+
+    // Makes e primitive with a positive leading coefficient, returns
+    // false if e does not mention any variable
+    static bool canonicalize(fixed_expression& e) {
+      int lead = -1;
+      rational g = gcd(rational::zero(), e[N]);
+      for (int j = 0; j < N; j++) {
+        if (e[j].sign() != 0) {
+          if (lead == -1) {
+            lead = j;
+          }
+          g = gcd(g, e[j]);
+        }
+      }
+
+      if (lead == -1) {
+        return false;
+      }
+
+      if (e[lead].sign() < 0) {
+        g.negate();
+      }
+      if (g != rational::one()) {
+        for (int j = 0; j <= N; j++) {
+          e[j] /= g;
+        }
+      }
+      return true;
+    }
+
+    static bool expr_less(const fixed_expression& l, const fixed_expression& r) {
+      for (int j = 0; j <= N; j++) {
+        int c = l[j].compare(r[j]);
+        if (c != 0) {
+          return c < 0;
+        }
+      }
+      return false;
+    }
+
+    static bool expr_equal(const fixed_expression& l, const fixed_expression& r) {
+      for (int j = 0; j <= N; j++) {
+        if (!l[j].equals(r[j])) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static void sort_unique_exprs(std::vector<fixed_expression>& exprs) {
+      std::sort(begin(exprs), end(exprs), expr_less);
+      exprs.erase(std::unique(begin(exprs), end(exprs), expr_equal), end(exprs));
+    }
+
+    // Canonical resultants of in with respect to var, plus the members of
+    // in that do not mention it
+    static void project(const std::vector<fixed_expression>& in,
+                        const int var,
+                        std::vector<fixed_expression>& out) {
+      std::vector<int> mentioning;
+      for (int i = 0; i < (int) in.size(); i++) {
+        if (in[i][var].sign() == 0) {
+          out.push_back(in[i]);
+        } else {
+          mentioning.push_back(i);
+        }
+      }
+
+      for (int i = 0; i < (int) mentioning.size(); i++) {
+        const fixed_expression& a = in[mentioning[i]];
+        for (int j = i + 1; j < (int) mentioning.size(); j++) {
+          const fixed_expression& b = in[mentioning[j]];
+
+          fixed_expression res;
+          for (int k = 0; k <= N; k++) {
+            if (k != var) {
+              res[k] = b[var] * a[k];
+              res[k].submul(a[var], b[k]);
+            }
+          }
+          if (canonicalize(res)) {
+            out.push_back(std::move(res));
+          }
+        }
+      }
+
+      sort_unique_exprs(out);
+    }
+
+    bool lift(std::integral_constant<int, -1>) {
+      std::fill(begin(leaf_words), end(leaf_words), 0);
+      for (int k = 0; k < (int) constraint_exprs.size(); k++) {
+        const fixed_expression& e = constraint_exprs[k];
+        rational val = e[N];
+        for (int j = 0; j < N; j++) {
+          val.addmul(pt[j], e[j]);
+        }
+        leaf_words[k / signs_per_word] |=
+          pack_sign(val.sign()) << (2 * (k % signs_per_word));
+      }
+      return pattern.matches(leaf_words.data());
+    }
+
+    template<int L>
+    bool lift(std::integral_constant<int, L>) {
+      const int var = N - 1 - L;
+
+      std::vector<rational>& rs = roots[L];
+      rs.clear();
+      for (const auto& e : levels[L]) {
+        if (e[var].sign() == 0) {
+          continue;
+        }
+
+        rational b = e[N];
+        for (int j = 0; j < var; j++) {
+          b.addmul(pt[j], e[j]);
+        }
+        b.negate();
+        b /= e[var];
+        rs.push_back(std::move(b));
+      }
+      sort_unique_roots(rs, sort_buf);
+
+      for (auto& r : build_test_points(rs, mode)) {
+        pt[var] = std::move(r);
+        if (lift(std::integral_constant<int, L - 1>())) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  public:
+
+    fixed_context(const std::vector<constraint>& constraints,
+                  const sample_mode mode_) :
+      pattern(compile_constraints(constraints)),
+      mode(mode_),
+      leaf_words((constraints.size() + signs_per_word - 1) / signs_per_word) {
+      for (const auto& con : constraints) {
+        fixed_expression e;
+        for (const auto& cf : con.first->integer_coefficients()) {
+          assert(cf.first < N);
+          e[cf.first] = cf.second;
+        }
+        e[N] = con.first->integer_const();
+
+        // Content is positive, so the integer part has the same signs
+        constraint_exprs.push_back(e);
+        if (canonicalize(e)) {
+          levels[0].push_back(std::move(e));
+        }
+      }
+      sort_unique_exprs(levels[0]);
+
+      for (int l = 1; l < N; l++) {
+        project(levels[l - 1], N - l, levels[l]);
+      }
+    }
+
+    maybe<std::map<variable, rational> > solve() {
+      if (!lift(std::integral_constant<int, N - 1>())) {
+        return maybe<std::map<variable, rational> >();
+      }
+
+      std::map<variable, rational> model;
+      for (int j = 0; j < N; j++) {
+        model[j] = pt[j];
+      }
+      return maybe<std::map<variable, rational> >(std::move(model));
+    }
+  };
+
+}
@@ -0,0 +1,292 @@
+#include "gmp_pool.h"
+
+#include <gmp.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace LinCAD {
+
+  static const size_t num_size_classes = 8;
+  static const size_t min_class_bytes = 16;
+  static const size_t max_class_bytes = min_class_bytes << (num_size_classes - 1);
+  static const int chunk_shift = 16;
+  static const size_t chunk_bytes = ((size_t) 1) << chunk_shift;
+
+  // Pooled blocks are preceded by a header pointing back at the arena they
+  // were carved from. Chunks are aligned to their size, so the chunk that
+  // holds a block is found by rounding its address down.
+  struct alignas(16) block_header {
+    gmp_arena_state* owner;
+    size_t size_class;
+  };
+
+  struct free_block {
+    free_block* next;
+  };
+
+  struct gmp_arena_state {
+    free_block* free_lists[num_size_classes];
+    std::vector<char*> chunks;
+    char* bump;
+    char* bump_end;
+
+    // Outstanding blocks, plus one while the arena is open
+    std::atomic<long> refs;
+    gmp_arena_state* enclosing;
+
+    gmp_arena_state(gmp_arena_state* enclosing_) :
+      bump(nullptr), bump_end(nullptr), refs(1), enclosing(enclosing_) {
+      for (size_t i = 0; i < num_size_classes; i++) {
+        free_lists[i] = nullptr;
+      }
+    }
+
+    ~gmp_arena_state();
+  };
+
+  // Allocation functions GMP used before the pool was installed, blocks
+  // outside the pool's chunks are handed back to them
+  static void* (*system_alloc)(size_t);
+  static void* (*system_realloc)(void*, size_t, size_t);
+  static void (*system_free)(void*, size_t);
+
+  // Which 64 KiB regions of the address space hold a live chunk, as a two
+  // level radix map over 48 bit addresses like a malloc page map. Lookups
+  // are two atomic loads and never lock, so frees of memory that has
+  // nothing to do with the pool stay cheap. Leaves are created on first
+  // use and never freed, GMP values in other static objects may be freed
+  // after this file's statics are gone.
+  static const int address_bits = 48;
+  static const int leaf_bits = 16;
+  static const int root_bits = address_bits - chunk_shift - leaf_bits;
+
+  static std::atomic<std::atomic<bool>*> chunk_map[((size_t) 1) << root_bits];
+
+  static bool chunk_map_index(const void* ptr, size_t& root, size_t& leaf) {
+    uintptr_t addr = (uintptr_t) ptr;
+    if ((addr >> address_bits) != 0) {
+      return false;
+    }
+    size_t region = addr >> chunk_shift;
+    root = region >> leaf_bits;
+    leaf = region & ((((size_t) 1) << leaf_bits) - 1);
+    return true;
+  }
+
+  static bool register_chunk(char* chunk) {
+    size_t root;
+    size_t leaf;
+    if (!chunk_map_index(chunk, root, leaf)) {
+      return false;
+    }
+
+    std::atomic<bool>* leaves = chunk_map[root].load(std::memory_order_acquire);
+    if (leaves == nullptr) {
+      std::atomic<bool>* fresh = static_cast<std::atomic<bool>*>
+        (std::calloc(((size_t) 1) << leaf_bits, sizeof(std::atomic<bool>)));
+      if (fresh == nullptr) {
+        return false;
+      }
+      if (chunk_map[root].compare_exchange_strong(leaves, fresh,
+                                                  std::memory_order_acq_rel)) {
+        leaves = fresh;
+      } else {
+        std::free(fresh);
+      }
+    }
+
+    leaves[leaf].store(true, std::memory_order_release);
+    return true;
+  }
+
+  static void unregister_chunk(char* chunk) {
+    size_t root = 0;
+    size_t leaf = 0;
+    chunk_map_index(chunk, root, leaf);
+    chunk_map[root].load(std::memory_order_acquire)[leaf]
+      .store(false, std::memory_order_release);
+  }
+
+  static bool is_pooled(void* ptr) {
+    size_t root;
+    size_t leaf;
+    if (!chunk_map_index(ptr, root, leaf)) {
+      return false;
+    }
+
+    std::atomic<bool>* leaves = chunk_map[root].load(std::memory_order_acquire);
+    return leaves != nullptr && leaves[leaf].load(std::memory_order_acquire);
+  }
+
+  gmp_arena_state::~gmp_arena_state() {
+    for (auto chunk : chunks) {
+      unregister_chunk(chunk);
+      std::free(chunk);
+    }
+  }
+
+  static thread_local gmp_arena_state* active_arena = nullptr;
+  static thread_local gmp_pool_stats pool_stats = {0, 0, 0, 0};
+
+  static size_t size_class_of(const size_t bytes) {
+    size_t cls = 0;
+    size_t cls_bytes = min_class_bytes;
+    while (cls_bytes < bytes) {
+      cls_bytes <<= 1;
+      cls++;
+    }
+    return cls;
+  }
+
+  static size_t class_bytes(const size_t cls) {
+    return min_class_bytes << cls;
+  }
+
+  static void release_ref(gmp_arena_state* arena) {
+    if (arena->refs.fetch_sub(1) == 1) {
+      pool_stats.arenas_released++;
+      delete arena;
+    }
+  }
+
+  static block_header* carve(gmp_arena_state* arena, const size_t cls) {
+    free_block* fb = arena->free_lists[cls];
+    if (fb != nullptr) {
+      arena->free_lists[cls] = fb->next;
+      return reinterpret_cast<block_header*>(fb);
+    }
+
+    size_t stride = sizeof(block_header) + class_bytes(cls);
+    if (arena->bump == nullptr || arena->bump + stride > arena->bump_end) {
+      void* mem = nullptr;
+      if (posix_memalign(&mem, chunk_bytes, chunk_bytes) != 0) {
+        return nullptr;
+      }
+      char* chunk = static_cast<char*>(mem);
+      if (!register_chunk(chunk)) {
+        std::free(chunk);
+        return nullptr;
+      }
+      arena->chunks.push_back(chunk);
+      arena->bump = chunk;
+      arena->bump_end = chunk + chunk_bytes;
+      pool_stats.chunks_allocated++;
+    }
+
+    block_header* h = reinterpret_cast<block_header*>(arena->bump);
+    arena->bump += stride;
+    return h;
+  }
+
+  static void* pool_alloc(size_t bytes) {
+    gmp_arena_state* arena = active_arena;
+    if (arena != nullptr && bytes <= max_class_bytes) {
+      size_t cls = size_class_of(bytes);
+      block_header* h = carve(arena, cls);
+      if (h != nullptr) {
+        h->owner = arena;
+        h->size_class = cls;
+        arena->refs.fetch_add(1);
+        pool_stats.pooled_allocs++;
+        return h + 1;
+      }
+    }
+
+    pool_stats.system_allocs++;
+    return system_alloc(bytes);
+  }
+
+  static void pool_free(void* ptr, size_t bytes) {
+    if (ptr == nullptr) {
+      return;
+    }
+
+    if (!is_pooled(ptr)) {
+      system_free(ptr, bytes);
+      return;
+    }
+
+    block_header* h = static_cast<block_header*>(ptr) - 1;
+    gmp_arena_state* owner = h->owner;
+
+    // Only the thread that has the arena open may touch its free lists,
+    // open arenas are always reachable from that thread's active chain
+    for (gmp_arena_state* a = active_arena; a != nullptr; a = a->enclosing) {
+      if (a == owner) {
+        free_block* fb = reinterpret_cast<free_block*>(h);
+        fb->next = owner->free_lists[h->size_class];
+        owner->free_lists[h->size_class] = fb;
+        break;
+      }
+    }
+
+    release_ref(owner);
+  }
+
+  static void* pool_realloc(void* ptr, size_t old_bytes, size_t new_bytes) {
+    if (ptr == nullptr) {
+      return pool_alloc(new_bytes);
+    }
+
+    if (!is_pooled(ptr)) {
+      if (active_arena == nullptr || new_bytes > max_class_bytes) {
+        return system_realloc(ptr, old_bytes, new_bytes);
+      }
+    } else {
+      block_header* h = static_cast<block_header*>(ptr) - 1;
+      if (new_bytes <= class_bytes(h->size_class)) {
+        return ptr;
+      }
+    }
+
+    void* fresh = pool_alloc(new_bytes);
+    std::memcpy(fresh, ptr, old_bytes < new_bytes ? old_bytes : new_bytes);
+    pool_free(ptr, old_bytes);
+    return fresh;
+  }
+
+  void install_gmp_pool() {
+    static bool installed = false;
+    if (installed) {
+      return;
+    }
+    mp_get_memory_functions(&system_alloc, &system_realloc, &system_free);
+    mp_set_memory_functions(pool_alloc, pool_realloc, pool_free);
+    installed = true;
+  }
+
+  static struct gmp_pool_installer {
+    gmp_pool_installer() { install_gmp_pool(); }
+  } install_at_load;
+
+  gmp_pool_stats gmp_pool_statistics() {
+    return pool_stats;
+  }
+
+  gmp_arena::gmp_arena() : state(new gmp_arena_state(active_arena)) {
+    active_arena = state;
+  }
+
+  gmp_arena::~gmp_arena() {
+    assert(active_arena == state);
+
+    active_arena = state->enclosing;
+    release_ref(state);
+  }
+
+  gmp_system_memory::gmp_system_memory() : suspended(active_arena) {
+    active_arena = nullptr;
+  }
+
+  gmp_system_memory::~gmp_system_memory() {
+    assert(active_arena == nullptr);
+
+    active_arena = suspended;
+  }
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+
+namespace LinCAD {
+
+  struct gmp_pool_stats {
+    unsigned long pooled_allocs;
+    unsigned long system_allocs;
+    unsigned long chunks_allocated;
+    unsigned long arenas_released;
+  };
+
+  // Per-thread counters, reset only when the thread exits
+  gmp_pool_stats gmp_pool_statistics();
+
+  // Installs the pooled allocation functions with mp_set_memory_functions.
+  // This runs once from a static initializer in gmp_pool.cpp and later
+  // calls are no-ops. GMP memory allocated before that, by other code in
+  // the process, stays valid: blocks outside the pool's chunks are passed
+  // to the allocation functions that were installed before.
+  void install_gmp_pool();
+
+  struct gmp_arena_state;
+
+  // While an arena is open, GMP limbs allocated on the opening thread are
+  // carved out of its size-classed chunks and recycled through its free
+  // lists. Closing the arena releases all of its chunks at once when the
+  // last block allocated from it is freed, so values that outlive the
+  // arena stay valid. Blocks freed from another thread are not recycled.
+  class gmp_arena {
+    gmp_arena_state* state;
+
+  public:
+    gmp_arena();
+
+    gmp_arena(const gmp_arena&) = delete;
+    gmp_arena& operator=(const gmp_arena&) = delete;
+
+    ~gmp_arena();
+  };
+
+  // While open, GMP memory allocated on this thread comes from the system
+  // allocator even inside an arena, for values that outlive the arena
+  class gmp_system_memory {
+    gmp_arena_state* suspended;
+
+  public:
+    gmp_system_memory();
+
+    gmp_system_memory(const gmp_system_memory&) = delete;
+    gmp_system_memory& operator=(const gmp_system_memory&) = delete;
+
+    ~gmp_system_memory();
+  };
+
+}
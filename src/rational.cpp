@@ -1,5 +1,280 @@
 #include "rational.h"
 
-namespace lqe {
+#include "gmp_pool.h"
+
+#include <climits>
+
+namespace LinCAD {
+
+  static void mpz_set_int64(mpz_t z, const int64_t v) {
+    if (v >= LONG_MIN && v <= LONG_MAX) {
+      mpz_set_si(z, (long) v);
+      return;
+    }
+
+    uint64_t mag = v < 0 ? -((uint64_t) v) : (uint64_t) v;
+    mpz_import(z, 1, 1, sizeof(mag), 0, 0, &mag);
+    if (v < 0) {
+      mpz_neg(z, z);
+    }
+  }
+
+  static bool mpz_fits_int64(const mpz_t z) {
+    return mpz_fits_slong_p(z) && mpz_get_si(z) != INT64_MIN;
+  }
+
+  // Read-only mpq view of a rational, small values are expanded into a
+  // temporary that lives as long as the operand.
+  struct mpq_operand {
+    mpq_t tmp;
+    mpq_srcptr ptr;
+    bool owns_tmp;
+
+    mpq_operand(const rational& r) : owns_tmp(r.big == nullptr) {
+      if (r.big != nullptr) {
+        ptr = r.big->val;
+        return;
+      }
+
+      mpq_init(tmp);
+      mpz_set_int64(mpq_numref(tmp), r.num);
+      mpz_set_int64(mpq_denref(tmp), r.den);
+      ptr = tmp;
+    }
+
+    ~mpq_operand() {
+      if (owns_tmp) {
+        mpq_clear(tmp);
+      }
+    }
+  };
+
+  big_rational* rational::new_big() {
+    big_rational* b = new big_rational;
+    mpq_init(b->val);
+    b->refs.store(1);
+    b->table = nullptr;
+    b->hash = 0;
+    return b;
+  }
+
+  void rational::free_big(big_rational* b) {
+    mpq_clear(b->val);
+    delete b;
+  }
+
+  void rational::set_big(const int64_t n, const int64_t d) {
+    assert(big == nullptr);
+
+    big = new_big();
+    mpz_set_int64(mpq_numref(big->val), n);
+    mpz_set_int64(mpq_denref(big->val), d);
+    mpq_canonicalize(big->val);
+    demote();
+  }
+
+  void rational::unshare() {
+    if (big == nullptr) {
+      return;
+    }
+
+    big_rational* fresh = new_big();
+    mpq_set(fresh->val, big->val);
+    release();
+    big = fresh;
+  }
+
+  rational::rational(mpz_srcptr n) : big(new_big()) {
+    mpq_set_z(big->val, n);
+    demote();
+  }
+
+  // Returns a cell that only this rational refers to, copying the value
+  // out of a shared or interned cell first.
+  mpq_ptr rational::mutable_val() {
+    if (big == nullptr) {
+      big = new_big();
+      mpz_set_int64(mpq_numref(big->val), num);
+      mpz_set_int64(mpq_denref(big->val), den);
+      return big->val;
+    }
+
+    if (big->refs.load() > 1 || big->table != nullptr) {
+      big_rational* fresh = new_big();
+      mpq_set(fresh->val, big->val);
+      release();
+      big = fresh;
+    }
+    return big->val;
+  }
+
+  void rational::demote() {
+    if (big == nullptr) {
+      return;
+    }
+
+    mpz_srcptr n = mpq_numref(big->val);
+    mpz_srcptr d = mpq_denref(big->val);
+    if (!mpz_fits_int64(n) || !mpz_fits_int64(d)) {
+      return;
+    }
+
+    num = mpz_get_si(n);
+    den = mpz_get_si(d);
+    release();
+  }
+
+  static size_t hash_mpz(size_t h, mpz_srcptr z) {
+    h ^= (size_t) mpz_sgn(z) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    for (size_t i = 0; i < mpz_size(z); i++) {
+      h ^= (size_t) mpz_getlimbn(z, i) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    }
+    return h;
+  }
+
+  size_t rational::big_hash() const {
+    return hash_mpz(hash_mpz(0, mpq_numref(big->val)), mpq_denref(big->val));
+  }
+
+  void rational::big_add(const rational& l) {
+    mpq_ptr v = mutable_val();
+    mpq_operand b(l);
+    mpq_add(v, v, b.ptr);
+    demote();
+  }
+
+  void rational::big_sub(const rational& l) {
+    mpq_ptr v = mutable_val();
+    mpq_operand b(l);
+    mpq_sub(v, v, b.ptr);
+    demote();
+  }
+
+  void rational::big_mul(const rational& l) {
+    mpq_ptr v = mutable_val();
+    mpq_operand b(l);
+    mpq_mul(v, v, b.ptr);
+    demote();
+  }
+
+  void rational::big_div(const rational& l) {
+    mpq_ptr v = mutable_val();
+    mpq_operand b(l);
+    mpq_div(v, v, b.ptr);
+    demote();
+  }
+
+  void rational::big_addmul(const rational& b, const rational& c) {
+    mpq_t prod;
+    mpq_init(prod);
+    {
+      mpq_operand x(b);
+      mpq_operand y(c);
+      mpq_mul(prod, x.ptr, y.ptr);
+    }
+    mpq_ptr v = mutable_val();
+    mpq_add(v, v, prod);
+    mpq_clear(prod);
+    demote();
+  }
+
+  void rational::big_submul(const rational& b, const rational& c) {
+    mpq_t prod;
+    mpq_init(prod);
+    {
+      mpq_operand x(b);
+      mpq_operand y(c);
+      mpq_mul(prod, x.ptr, y.ptr);
+    }
+    mpq_ptr v = mutable_val();
+    mpq_sub(v, v, prod);
+    mpq_clear(prod);
+    demote();
+  }
+
+  int rational::big_compare(const rational& l) const {
+    if (big != nullptr && big == l.big) {
+      return 0;
+    }
+
+    mpq_operand a(*this);
+    mpq_operand b(l);
+    int c = mpq_cmp(a.ptr, b.ptr);
+    return (c > 0) - (c < 0);
+  }
+
+  rational rational::big_floor() const {
+    mpz_t q;
+    mpz_init(q);
+    mpz_fdiv_q(q, mpq_numref(big->val), mpq_denref(big->val));
+    rational res(q);
+    mpz_clear(q);
+    return res;
+  }
+
+  rational gcd(const rational& l, const rational& r) {
+    if (l.big == nullptr && r.big == nullptr) {
+      int64_t n = gcd64(l.num, r.num);
+      int64_t d;
+      if (!__builtin_mul_overflow(l.den / gcd64(l.den, r.den), r.den, &d)) {
+        return rational(n, d);
+      }
+    }
+
+    mpq_operand a(l);
+    mpq_operand b(r);
+
+    mpq_t g;
+    mpq_init(g);
+    mpz_gcd(mpq_numref(g), mpq_numref(a.ptr), mpq_numref(b.ptr));
+    mpz_lcm(mpq_denref(g), mpq_denref(a.ptr), mpq_denref(b.ptr));
+    rational res(g);
+    mpq_clear(g);
+    return res;
+  }
+
+  void rational_table::intern(rational& r) {
+    big_rational* b = r.big;
+    if (b == nullptr || b->table == this) {
+      return;
+    }
+
+    if (b->table == nullptr) {
+      b->hash = r.big_hash();
+    }
+
+    auto it = cells.find(b);
+    if (it != end(cells)) {
+      (*it)->refs.fetch_add(1);
+      r.release();
+      r.big = *it;
+      return;
+    }
+
+    // Interned cells live as long as the table, so they never keep the
+    // limbs of the arena the value was computed in
+    big_rational* owned;
+    {
+      gmp_system_memory system;
+      owned = rational::new_big();
+      mpq_set(owned->val, b->val);
+    }
+    owned->hash = b->hash;
+    owned->refs.store(2);
+    r.release();
+    r.big = owned;
+
+    owned->table = this;
+    cells.insert(owned);
+  }
+
+  rational_table::~rational_table() {
+    for (auto b : cells) {
+      b->table = nullptr;
+      if (b->refs.fetch_sub(1) == 1) {
+        rational::free_big(b);
+      }
+    }
+  }
 
 }
@@ -1,71 +1,523 @@
 #pragma once
 
 #include <gmp.h>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <unordered_set>
+#include <utility>
 
 namespace LinCAD {
 
+  static inline int64_t gcd64(int64_t a, int64_t b) {
+    uint64_t x = a < 0 ? -((uint64_t) a) : (uint64_t) a;
+    uint64_t y = b < 0 ? -((uint64_t) b) : (uint64_t) b;
+    while (y != 0) {
+      uint64_t t = x % y;
+      x = y;
+      y = t;
+    }
+    return (int64_t) x;
+  }
+
+  class rational_table;
+
+  // GMP value of a big rational, shared by reference count between copies.
+  // A cell is never modified while it is shared, and cells owned by a
+  // rational_table are the only cell with their value in that table.
+  struct big_rational {
+    mpq_t val;
+    std::atomic<long> refs;
+    const rational_table* table;
+    size_t hash;
+  };
+
+  // Values whose reduced numerator and denominator fit in an int64_t are
+  // stored inline in num / den, and big is only allocated once an
+  // operation overflows. Big results that fit again are demoted, so every
+  // value has exactly one representation.
   class rational {
   protected:
-    mpq_t val;
+    int64_t num;
+    int64_t den;
+    big_rational* big;
+
+    friend struct mpq_operand;
+    friend class rational_table;
+    friend rational gcd(const rational& l, const rational& r);
+
+    // Stores n / d if the reduced fraction fits, INT64_MIN is excluded
+    // so that negation can never overflow.
+    bool set_small(int64_t n, int64_t d) {
+      assert(d != 0);
+      if (n == INT64_MIN || d == INT64_MIN) {
+        return false;
+      }
+
+      if (d < 0) {
+        n = -n;
+        d = -d;
+      }
+
+      int64_t g = gcd64(n, d);
+      if (g > 1) {
+        n /= g;
+        d /= g;
+      }
+
+      if (n == 0) {
+        d = 1;
+      }
+
+      num = n;
+      den = d;
+      return true;
+    }
+
+    bool add_small(const int64_t n2, const int64_t d2) {
+      int64_t n, d;
+      if (den == d2) {
+        d = den;
+        if (__builtin_add_overflow(num, n2, &n)) {
+          return false;
+        }
+      } else {
+        int64_t g = gcd64(den, d2);
+        int64_t ls, rs;
+        if (__builtin_mul_overflow(num, d2 / g, &ls) ||
+            __builtin_mul_overflow(n2, den / g, &rs) ||
+            __builtin_add_overflow(ls, rs, &n) ||
+            __builtin_mul_overflow(den, d2 / g, &d)) {
+          return false;
+        }
+      }
+      return set_small(n, d);
+    }
+
+    static bool mul_small(const int64_t n1, const int64_t d1,
+                          const int64_t n2, const int64_t d2,
+                          int64_t& n, int64_t& d) {
+      int64_t g1 = gcd64(n1, d2);
+      int64_t g2 = gcd64(n2, d1);
+      return !__builtin_mul_overflow(n1 / g1, n2 / g2, &n) &&
+        !__builtin_mul_overflow(d1 / g2, d2 / g1, &d);
+    }
+
+    bool mul_small(const int64_t n2, const int64_t d2) {
+      int64_t n, d;
+      return mul_small(num, den, n2, d2, n, d) && set_small(n, d);
+    }
+
+    void set_big(const int64_t n, const int64_t d);
+    mpq_ptr mutable_val();
+    void demote();
+
+    void release() {
+      if (big != nullptr) {
+        if (big->refs.fetch_sub(1) == 1) {
+          free_big(big);
+        }
+        big = nullptr;
+      }
+    }
+
+    static big_rational* new_big();
+    static void free_big(big_rational* b);
+    size_t big_hash() const;
+
+    void big_add(const rational& l);
+    void big_sub(const rational& l);
+    void big_mul(const rational& l);
+    void big_div(const rational& l);
+    void big_addmul(const rational& b, const rational& c);
+    void big_submul(const rational& b, const rational& c);
+    int big_compare(const rational& l) const;
+    rational big_floor() const;
 
   public:
 
-    rational() {
-      mpq_init(val);
-      mpq_set_str(val, "0", 10);
-      mpq_canonicalize(val);
+    rational() : num(0), den(1), big(nullptr) {}
+
+    rational(const int n) : num(n), den(1), big(nullptr) {}
+
+    rational(const long n) : big(nullptr) {
+      if (!set_small(n, 1)) {
+        set_big(n, 1);
+      }
+    }
+
+    rational(const long long n) : big(nullptr) {
+      if (!set_small(n, 1)) {
+        set_big(n, 1);
+      }
     }
 
-    rational(mpq_t tmp) {
-      mpq_init(val);
-      mpq_swap(val, tmp);
-      mpq_canonicalize(val);
+    rational(const int64_t n, const int64_t d) : big(nullptr) {
+      if (!set_small(n, d)) {
+        set_big(n, d);
+      }
     }
 
-    rational(const std::string& value) {
-      mpq_init(val);
-      mpq_set_str(val, value.c_str(), 10);
-      mpq_canonicalize(val);
+    explicit rational(mpz_srcptr n);
+
+    rational(mpq_t tmp) : big(new_big()) {
+      mpq_swap(big->val, tmp);
+      mpq_canonicalize(big->val);
+      demote();
+    }
+
+    rational(const std::string& value) : big(new_big()) {
+      mpq_set_str(big->val, value.c_str(), 10);
+      mpq_canonicalize(big->val);
+      demote();
+    }
+
+    rational(const rational& other) :
+      num(other.num), den(other.den), big(other.big) {
+      if (big != nullptr) {
+        big->refs.fetch_add(1);
+      }
     }
 
-    int sign() const { return mpq_sgn(val); }
+    rational& operator=(const rational& other) {
+      if (other.big != nullptr) {
+        other.big->refs.fetch_add(1);
+      }
+      release();
+
+      num = other.num;
+      den = other.den;
+      big = other.big;
+      return *this;
+    }
+
+    rational(rational&& other) noexcept :
+      num(other.num), den(other.den), big(other.big) {
+      other.num = 0;
+      other.den = 1;
+      other.big = nullptr;
+    }
+
+    rational& operator=(rational&& other) noexcept {
+      if (this == &other) {
+        return *this;
+      }
+
+      release();
+
+      num = other.num;
+      den = other.den;
+      big = other.big;
+      other.num = 0;
+      other.den = 1;
+      other.big = nullptr;
+      return *this;
+    }
+
+    void swap(rational& other) noexcept {
+      std::swap(num, other.num);
+      std::swap(den, other.den);
+      std::swap(big, other.big);
+    }
+
+    ~rational() {
+      release();
+    }
+
+    bool is_small() const { return big == nullptr; }
+
+    // Within four ulps of the exact value, see to_interval in filter.h for
+    // the bounds of each case
+    double to_double() const {
+      if (big == nullptr) {
+        return ((double) num) / ((double) den);
+      }
+      return mpq_get_d(big->val);
+    }
+
+    bool is_integer() const {
+      if (big == nullptr) {
+        return den == 1;
+      }
+      return mpz_cmp_ui(mpq_denref(big->val), 1) == 0;
+    }
+
+    rational floor() const {
+      if (big == nullptr) {
+        int64_t q = num / den;
+        if (num % den != 0 && num < 0) {
+          q--;
+        }
+        return rational(q);
+      }
+      return big_floor();
+    }
+
+    rational ceil() const {
+      rational neg(*this);
+      neg.negate();
+      rational neg_floor = neg.floor();
+      neg_floor.negate();
+      return neg_floor;
+    }
+
+    // Bits in the numerator plus bits in the denominator
+    int bit_length() const {
+      if (big == nullptr) {
+        uint64_t n = num < 0 ? -((uint64_t) num) : (uint64_t) num;
+        int nbits = n == 0 ? 1 : 64 - __builtin_clzll(n);
+        return nbits + 64 - __builtin_clzll((uint64_t) den);
+      }
+      return mpz_sizeinbase(mpq_numref(big->val), 2) +
+        mpz_sizeinbase(mpq_denref(big->val), 2);
+    }
+
+    // Stores the value in out when it is an integer held inline
+    bool small_integer(int64_t& out) const {
+      if (big != nullptr || den != 1) {
+        return false;
+      }
+      out = num;
+      return true;
+    }
+
+    // Stores the numerator and denominator in n and d when the value is
+    // held inline
+    bool small_fraction(int64_t& n, int64_t& d) const {
+      if (big != nullptr) {
+        return false;
+      }
+      n = num;
+      d = den;
+      return true;
+    }
+
+    // Heap bytes behind the value, a shared cell is counted in full by
+    // every rational that refers to it
+    size_t heap_bytes() const {
+      if (big == nullptr) {
+        return 0;
+      }
+      return sizeof(big_rational) +
+        (mpq_numref(big->val)->_mp_alloc + mpq_denref(big->val)->_mp_alloc) *
+        sizeof(mp_limb_t);
+    }
+
+    bool is_interned() const {
+      return big != nullptr && big->table != nullptr;
+    }
+
+    // Gives a big value a cell of its own with limbs from the current GMP
+    // allocator, so it no longer holds on to the arena it was computed in
+    void unshare();
+
+    int sign() const {
+      if (big == nullptr) {
+        return (num > 0) - (num < 0);
+      }
+      return mpq_sgn(big->val);
+    }
 
     bool equals(const rational& l) const {
-      if (mpq_equal(val, l.val)) {
+      if (big == nullptr && l.big == nullptr) {
+        return num == l.num && den == l.den;
+      }
+
+      if (big == l.big) {
+        return true;
+      }
+
+      if (big == nullptr || l.big == nullptr) {
+        return false;
+      }
+
+      if (big->table != nullptr && big->table == l.big->table) {
+        return false;
+      }
+
+      if (mpq_equal(big->val, l.big->val)) {
 	return true;
       }
       return false;
     }
 
+    size_t hash() const {
+      if (big == nullptr) {
+        uint64_t h = ((uint64_t) num) * 0x9e3779b97f4a7c15ULL;
+        h ^= ((uint64_t) den) + 0x7f4a7c159e3779b9ULL + (h << 6) + (h >> 2);
+        return (size_t) h;
+      }
+
+      if (big->table != nullptr) {
+        return big->hash;
+      }
+      return big_hash();
+    }
+
+    static const rational& zero() {
+      static const rational z(0);
+      return z;
+    }
+
+    static const rational& one() {
+      static const rational o(1);
+      return o;
+    }
+
+    static const rational& minus_one() {
+      static const rational m(-1);
+      return m;
+    }
+
+    int compare(const rational& l) const {
+      if (big == nullptr && l.big == nullptr) {
+        if (den == l.den) {
+          return (num > l.num) - (num < l.num);
+        }
+        __int128 a = ((__int128) num) * l.den;
+        __int128 b = ((__int128) l.num) * den;
+        return (a > b) - (a < b);
+      }
+      return big_compare(l);
+    }
+
+    void negate() {
+      if (big == nullptr) {
+        num = -num;
+        return;
+      }
+      mpq_ptr v = mutable_val();
+      mpq_neg(v, v);
+    }
+
+    rational& operator+=(const rational& l) {
+      if (big != nullptr || l.big != nullptr || !add_small(l.num, l.den)) {
+        big_add(l);
+      }
+      return *this;
+    }
+
+    rational& operator-=(const rational& l) {
+      if (big != nullptr || l.big != nullptr || !add_small(-l.num, l.den)) {
+        big_sub(l);
+      }
+      return *this;
+    }
+
+    rational& operator*=(const rational& l) {
+      if (big != nullptr || l.big != nullptr || !mul_small(l.num, l.den)) {
+        big_mul(l);
+      }
+      return *this;
+    }
+
+    rational& operator/=(const rational& l) {
+      assert(l.sign() != 0);
+
+      if (big != nullptr || l.big != nullptr ||
+          !mul_small(l.num < 0 ? -l.den : l.den, l.num < 0 ? -l.num : l.num)) {
+        big_div(l);
+      }
+      return *this;
+    }
+
+    // this += b*c without materializing the product
+    rational& addmul(const rational& b, const rational& c) {
+      int64_t n, d;
+      if (big != nullptr || b.big != nullptr || c.big != nullptr ||
+          !mul_small(b.num, b.den, c.num, c.den, n, d) ||
+          n == INT64_MIN ||
+          !add_small(n, d)) {
+        big_addmul(b, c);
+      }
+      return *this;
+    }
+
+    // this -= b*c without materializing the product
+    rational& submul(const rational& b, const rational& c) {
+      int64_t n, d;
+      if (big != nullptr || b.big != nullptr || c.big != nullptr ||
+          !mul_small(b.num, b.den, c.num, c.den, n, d) ||
+          n == INT64_MIN ||
+          !add_small(-n, d)) {
+        big_submul(b, c);
+      }
+      return *this;
+    }
+
     rational plus(const rational& l) const {
-      mpq_t sum;
-      mpq_init(sum);
-      mpq_add(sum, val, l.val);
-      return rational(sum);
+      rational sum(*this);
+      sum += l;
+      return sum;
     }
 
     rational times(const rational& l) const {
-      mpq_t prod;
-      mpq_init(prod);
-      mpq_mul(prod, val, l.val);
-      return rational(prod);
+      rational prod(*this);
+      prod *= l;
+      return prod;
     }
 
     rational divide(const rational& l) const {
-      mpq_t prod;
-      mpq_init(prod);
-      mpq_div(prod, val, l.val);
-      return rational(prod);
+      rational quot(*this);
+      quot /= l;
+      return quot;
     }
-    
+
     void print(std::ostream& out) const {
-      out << val;
+      if (big == nullptr) {
+        out << num;
+        if (den != 1) {
+          out << "/" << den;
+        }
+        return;
+      }
+
+      out << big->val;
     }
-    
+
+  };
+
+  // gcd of the numerators over the lcm of the denominators, the largest
+  // rational g such that l / g and r / g are both integers. Always >= 0.
+  rational gcd(const rational& l, const rational& r);
+
+  // Hash-consing table for big rationals. Interning a value makes it share
+  // the table's cell for that value, so equal interned values compare and
+  // hash by pointer. Small values are already inline and are left alone.
+  class rational_table {
+    struct cell_hash {
+      size_t operator()(const big_rational* b) const { return b->hash; }
+    };
+
+    struct cell_equal {
+      bool operator()(const big_rational* l, const big_rational* r) const {
+        return mpq_equal(l->val, r->val);
+      }
+    };
+
+    std::unordered_set<big_rational*, cell_hash, cell_equal> cells;
+
+  public:
+
+    rational_table() {}
+
+    rational_table(const rational_table&) = delete;
+    rational_table& operator=(const rational_table&) = delete;
+
+    void intern(rational& r);
+
+    int size() const { return cells.size(); }
+
+    ~rational_table();
   };
 
+  inline void swap(rational& l, rational& r) {
+    l.swap(r);
+  }
+
   inline std::ostream& operator<<(std::ostream& out, const rational& r) {
     r.print(out);
     return out;
@@ -75,22 +527,51 @@ namespace LinCAD {
     return l.plus(r);
   }
 
+  inline rational operator+(rational&& l, const rational& r) {
+    l += r;
+    return std::move(l);
+  }
+
   inline rational operator*(const rational& l, const rational& r) {
     return l.times(r);
   }
-  
+
+  inline rational operator*(rational&& l, const rational& r) {
+    l *= r;
+    return std::move(l);
+  }
+
   inline rational operator/(const rational& l, const rational& r) {
     return l.divide(r);
   }
-  
+
+  inline rational operator/(rational&& l, const rational& r) {
+    l /= r;
+    return std::move(l);
+  }
+
   inline rational operator-(const rational& l) {
-    return l.times({"-1"});
+    rational neg(l);
+    neg.negate();
+    return neg;
+  }
+
+  inline rational operator-(rational&& l) {
+    l.negate();
+    return std::move(l);
   }
 
   inline rational operator-(const rational& l, const rational& r) {
-    return l.plus(-r);
+    rational diff(l);
+    diff -= r;
+    return diff;
   }
-  
+
+  inline rational operator-(rational&& l, const rational& r) {
+    l -= r;
+    return std::move(l);
+  }
+
   inline bool operator==(const rational& l, const rational& r) {
     return l.equals(r);
   }
@@ -100,7 +581,30 @@ namespace LinCAD {
   }
 
   inline bool operator<(const rational& l, const rational& r) {
-    return (l - r).sign() < 0;
+    return l.compare(r) < 0;
+  }
+
+  inline bool operator<=(const rational& l, const rational& r) {
+    return l.compare(r) <= 0;
   }
-  
+
+  inline bool operator>(const rational& l, const rational& r) {
+    return l.compare(r) > 0;
+  }
+
+  inline bool operator>=(const rational& l, const rational& r) {
+    return l.compare(r) >= 0;
+  }
+
+}
+
+namespace std {
+
+  template<>
+  struct hash<LinCAD::rational> {
+    size_t operator()(const LinCAD::rational& r) const {
+      return r.hash();
+    }
+  };
+
 }
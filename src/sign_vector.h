@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+namespace LinCAD {
+
+  // Signs packed two bits each, the low bit is set for nonzero values and
+  // the high bit for negative ones: 00 zero, 01 positive, 11 negative.
+  static inline uint64_t pack_sign(const int sign) {
+    return sign == 0 ? 0 : (sign > 0 ? 1 : 3);
+  }
+
+  static inline int unpack_sign(const uint64_t bits) {
+    return bits == 0 ? 0 : (bits == 1 ? 1 : -1);
+  }
+
+  static const int signs_per_word = 32;
+
+  // A batch of sign vectors of the same length, stored one after another
+  class sign_vectors {
+    int num_signs;
+    int words_per_vector;
+    // Counted separately, vectors of length 0 take no words
+    int count;
+    std::vector<uint64_t> words;
+
+  public:
+
+    sign_vectors() : num_signs(0), words_per_vector(0), count(0) {}
+
+    sign_vectors(const int num_signs_) :
+      num_signs(num_signs_),
+      words_per_vector((num_signs_ + signs_per_word - 1) / signs_per_word),
+      count(0) {}
+
+    int length() const { return num_signs; }
+    int num_words() const { return words_per_vector; }
+
+    int num_vectors() const { return count; }
+
+    // Appends a vector of all zero signs and returns its index
+    int add_vector() {
+      words.resize(words.size() + words_per_vector, 0);
+      return count++;
+    }
+
+    void set(const int v, const int i, const int sign) {
+      assert(i < num_signs);
+      uint64_t& w = words[v * words_per_vector + i / signs_per_word];
+      int shift = 2 * (i % signs_per_word);
+      w = (w & ~(((uint64_t) 3) << shift)) | (pack_sign(sign) << shift);
+    }
+
+    int get(const int v, const int i) const {
+      uint64_t w = words[v * words_per_vector + i / signs_per_word];
+      return unpack_sign((w >> (2 * (i % signs_per_word))) & 3);
+    }
+
+    const uint64_t* vector_words(const int v) const {
+      return words.data() + v * words_per_vector;
+    }
+
+    bool same_vector(const int v, const int u) const {
+      for (int w = 0; w < words_per_vector; w++) {
+        if (vector_words(v)[w] != vector_words(u)[w]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    size_t hash_vector(const int v) const {
+      size_t h = 0;
+      for (int w = 0; w < words_per_vector; w++) {
+        h ^= std::hash<uint64_t>()(vector_words(v)[w]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      }
+      return h;
+    }
+
+    // Index of the first vector with each distinct sign pattern
+    std::vector<int> distinct_vectors() const {
+      auto hash = [this](const int v) { return hash_vector(v); };
+      auto eq = [this](const int v, const int u) { return same_vector(v, u); };
+      std::unordered_set<int, decltype(hash), decltype(eq)> seen(16, hash, eq);
+
+      std::vector<int> distinct;
+      for (int v = 0; v < num_vectors(); v++) {
+        if (seen.insert(v).second) {
+          distinct.push_back(v);
+        }
+      }
+      return distinct;
+    }
+  };
+
+  // Required signs compiled to a mask and value per word, a vector
+  // matches when its masked words equal the values
+  class sign_pattern {
+    std::vector<uint64_t> mask;
+    std::vector<uint64_t> value;
+
+  public:
+
+    sign_pattern(const int num_signs) :
+      mask((num_signs + signs_per_word - 1) / signs_per_word, 0),
+      value((num_signs + signs_per_word - 1) / signs_per_word, 0) {}
+
+    // Requires the bits of sign i selected by bit_mask to equal bits
+    void require(const int i, const uint64_t bit_mask, const uint64_t bits) {
+      int shift = 2 * (i % signs_per_word);
+      mask[i / signs_per_word] |= bit_mask << shift;
+      value[i / signs_per_word] |= (bits & bit_mask) << shift;
+    }
+
+    bool matches(const uint64_t* sv) const {
+      uint64_t diff = 0;
+      for (int w = 0; w < (int) mask.size(); w++) {
+        diff |= (sv[w] & mask[w]) ^ value[w];
+      }
+      return diff == 0;
+    }
+
+    // Index of the first matching vector in the batch, or -1
+    int first_match(const sign_vectors& svs) const {
+      assert(svs.num_words() == (int) mask.size());
+      for (int v = 0; v < svs.num_vectors(); v++) {
+        if (matches(svs.vector_words(v))) {
+          return v;
+        }
+      }
+      return -1;
+    }
+  };
+
+}
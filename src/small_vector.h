@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace LinCAD {
+
+  // Contiguous vector that keeps up to N elements inline and only
+  // allocates once it grows past them.
+  template<typename T, int N>
+  class small_vector {
+    T* elems;
+    int sz;
+    int cap;
+    alignas(T) unsigned char inline_storage[N * sizeof(T)];
+
+    T* inline_elems() {
+      return reinterpret_cast<T*>(inline_storage);
+    }
+
+    bool is_inline() const {
+      return elems == reinterpret_cast<const T*>(inline_storage);
+    }
+
+    void destroy_all() {
+      for (int i = 0; i < sz; i++) {
+        elems[i].~T();
+      }
+      sz = 0;
+    }
+
+    void release_heap() {
+      if (!is_inline()) {
+        ::operator delete(elems);
+        elems = inline_elems();
+        cap = N;
+      }
+    }
+
+    void grow(const int new_cap) {
+      T* fresh = static_cast<T*>(::operator new(new_cap * sizeof(T)));
+      for (int i = 0; i < sz; i++) {
+        new (fresh + i) T(std::move(elems[i]));
+        elems[i].~T();
+      }
+      release_heap();
+      elems = fresh;
+      cap = new_cap;
+    }
+
+    void take(small_vector&& other) noexcept {
+      if (other.is_inline()) {
+        for (int i = 0; i < other.sz; i++) {
+          new (elems + i) T(std::move(other.elems[i]));
+        }
+        sz = other.sz;
+        other.destroy_all();
+        return;
+      }
+
+      elems = other.elems;
+      sz = other.sz;
+      cap = other.cap;
+      other.elems = other.inline_elems();
+      other.sz = 0;
+      other.cap = N;
+    }
+
+  public:
+
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    small_vector() : elems(inline_elems()), sz(0), cap(N) {}
+
+    small_vector(const small_vector& other) :
+      elems(inline_elems()), sz(0), cap(N) {
+      reserve(other.sz);
+      for (int i = 0; i < other.sz; i++) {
+        new (elems + i) T(other.elems[i]);
+      }
+      sz = other.sz;
+    }
+
+    small_vector(small_vector&& other) noexcept :
+      elems(inline_elems()), sz(0), cap(N) {
+      take(std::move(other));
+    }
+
+    small_vector& operator=(const small_vector& other) {
+      if (this != &other) {
+        small_vector cp(other);
+        *this = std::move(cp);
+      }
+      return *this;
+    }
+
+    small_vector& operator=(small_vector&& other) noexcept {
+      if (this != &other) {
+        destroy_all();
+        release_heap();
+        take(std::move(other));
+      }
+      return *this;
+    }
+
+    ~small_vector() {
+      destroy_all();
+      release_heap();
+    }
+
+    int size() const { return sz; }
+    bool empty() const { return sz == 0; }
+
+    // True once the elements have moved out of the inline storage
+    bool spilled() const { return !is_inline(); }
+
+    iterator begin() { return elems; }
+    iterator end() { return elems + sz; }
+    const_iterator begin() const { return elems; }
+    const_iterator end() const { return elems + sz; }
+
+    T& operator[](const int i) { return elems[i]; }
+    const T& operator[](const int i) const { return elems[i]; }
+
+    T& back() { return elems[sz - 1]; }
+    const T& back() const { return elems[sz - 1]; }
+
+    void reserve(const int n) {
+      if (n > cap) {
+        grow(n);
+      }
+    }
+
+    template<typename... Args>
+    void emplace_back(Args&&... args) {
+      if (sz == cap) {
+        grow(2 * cap);
+      }
+      new (elems + sz) T(std::forward<Args>(args)...);
+      sz++;
+    }
+
+    void push_back(const T& t) { emplace_back(t); }
+    void push_back(T&& t) { emplace_back(std::move(t)); }
+
+    void pop_back() {
+      assert(sz > 0);
+      sz--;
+      elems[sz].~T();
+    }
+
+    iterator insert(iterator pos, T t) {
+      int i = pos - elems;
+      emplace_back(std::move(t));
+      for (int j = sz - 1; j > i; j--) {
+        std::swap(elems[j], elems[j - 1]);
+      }
+      return elems + i;
+    }
+
+    iterator erase(iterator pos) {
+      for (iterator it = pos; it + 1 != end(); ++it) {
+        *it = std::move(*(it + 1));
+      }
+      pop_back();
+      return pos;
+    }
+
+    // Drops trailing elements, n <= size()
+    void truncate(const int n) {
+      while (sz > n) {
+        pop_back();
+      }
+    }
+
+    void clear() {
+      destroy_all();
+    }
+  };
+
+}
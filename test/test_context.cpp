@@ -1,8 +1,13 @@
 #define CATCH_CONFIG_MAIN
 
+#include <type_traits>
+
 #include "catch.hpp"
 
 #include "context.h"
+#include "expression_matrix.h"
+#include "filter.h"
+#include "gmp_pool.h"
 #include "rational.h"
 
 using namespace std;
@@ -14,7 +19,7 @@ namespace LinCAD {
 
     variable x = c.add_variable("x");
 
-    linear_expression* lp = c.add_linear_expression({{x, 1}}, -5);
+    const linear_expression* lp = c.add_linear_expression({{x, 1}}, -5);
     linear_expression expected({}, rational("0"));
 
     REQUIRE(lp->evaluate_at({{x, rational("5")}}) == expected);
@@ -28,12 +33,12 @@ namespace LinCAD {
     auto xmy = c.add_linear_expression({{x, 1}, {y, -1}}, 0);
     auto mxy = c.add_linear_expression({{-x, 1}, {y, 1}}, 0);
 
-    vector<linear_expression*> proj_set =
+    vector<const linear_expression*> proj_set =
       c.project_away({xmy, mxy}, y);
 
     REQUIRE(proj_set.size() == 1);
 
-    linear_expression* pj = proj_set[0];
+    const linear_expression* pj = proj_set[0];
 
     REQUIRE(pj->cof(y).sign() == 0);
   }
@@ -69,7 +74,7 @@ namespace LinCAD {
 
     auto xm3 = c.add_linear_expression({{x, 1}}, -3);
 
-    vector<linear_expression*> proj_set =
+    vector<const linear_expression*> proj_set =
       c.project_away({xm3}, y);
 
     REQUIRE(proj_set.size() == 1);
@@ -110,5 +115,782 @@ namespace LinCAD {
 
     REQUIRE(model.has_value());
   }
-  
+
+  TEST_CASE("Interning projected coefficients") {
+    context c;
+    c.set_intern_rationals(true);
+
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+
+    rational big("1180591620717411303424");
+    auto f0 = c.add_linear_expression(linear_expression({{x, big}, {y, rational(1)}}, rational(0)));
+    auto f1 = c.add_linear_expression({{x, 1}, {y, 2}}, 1);
+    auto f2 = c.add_linear_expression({{x, 1}, {y, 2}}, 5);
+
+    // (2 big - 1) x - 1 and (2 big - 1) x - 5, f1 and f2 only differ by a
+    // constant
+    vector<const linear_expression*> proj_set =
+      c.project_away({f0, f1, f2}, y);
+
+    REQUIRE(proj_set.size() == 2);
+    REQUIRE(c.num_interned_rationals() > 0);
+    REQUIRE(proj_set[0]->integer_cof(x).is_interned());
+    REQUIRE(proj_set[0]->integer_cof(x) == proj_set[1]->integer_cof(x));
+  }
+
+  TEST_CASE("Each solve releases its arena when it returns") {
+    context c;
+    c.set_intern_rationals(true);
+    c.set_fixed_dimensions(false);
+
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+    variable z = c.add_variable("z");
+
+    rational big("1180591620717411303424");
+    std::vector<maybe<map<variable, rational> > > models;
+    for (int i = 1; i <= 5; i++) {
+      rational k = big * rational(i);
+      auto f0 = c.add_linear_expression(linear_expression({{x, k}, {y, rational(1)}, {z, rational(i)}}, big));
+      auto f1 = c.add_linear_expression(linear_expression({{x, rational(1)}, {y, k}, {z, rational(-1)}}, rational(-3)));
+      c.add_constraint(f0, GREATER_THAN_ZERO);
+      c.add_constraint(f1, LESS_THAN_ZERO);
+
+      gmp_pool_stats before = gmp_pool_statistics();
+      models.push_back(c.solve_constraints());
+      REQUIRE(models.back().has_value());
+      REQUIRE(gmp_pool_statistics().arenas_released == before.arenas_released + 1);
+    }
+    REQUIRE(c.num_interned_rationals() > 0);
+  }
+
+  TEST_CASE("Expressions are stored in primitive integer form") {
+    context c;
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+
+    linear_expression l({{x, rational(1, 2)}, {y, rational(-3, 4)}}, rational(1, 4));
+
+    REQUIRE(l.integer_cof(x) == rational(2));
+    REQUIRE(l.integer_cof(y) == rational(-3));
+    REQUIRE(l.integer_const() == rational(1));
+    REQUIRE(l.get_content() == rational(1, 4));
+    REQUIRE(l.cof(y) == rational(-3, 4));
+
+    auto f0 = c.add_linear_expression({{x, 6}, {y, 4}}, 10);
+    auto f1 = c.add_linear_expression({{x, 9}, {y, -6}}, 3);
+
+    vector<const linear_expression*> proj_set = c.project_away({f0, f1}, y);
+
+    REQUIRE(proj_set.size() == 1);
+
+    const linear_expression* pj = proj_set[0];
+
+    // -6*(6x + 10) - 4*(9x + 3) = -72x - 72, kept in canonical form
+    REQUIRE(pj->integer_cof(x) == rational(1));
+    REQUIRE(pj->integer_const() == rational(1));
+    REQUIRE(pj->get_content() == rational(1));
+    REQUIRE(pj == c.add_linear_expression({{x, 1}}, 1));
+  }
+
+  TEST_CASE("Filtered sign of an expression at a point") {
+    context c;
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+
+    auto f = c.add_linear_expression({{x, 3}, {y, -2}}, -7);
+
+    reset_filter_statistics();
+
+    REQUIRE(f->sign_at({{x, rational(10)}, {y, rational(1)}}) == 1);
+    REQUIRE(f->sign_at({{x, rational(1, 3)}, {y, rational(-4)}}) == 1);
+    REQUIRE(f->sign_at({{x, rational(-1)}, {y, rational(1, 7)}}) == -1);
+    REQUIRE(filter_statistics().hits == 3);
+
+    REQUIRE(f->sign_at({{x, rational(3)}, {y, rational(1)}}) == 0);
+    REQUIRE(filter_statistics().misses == 1);
+  }
+
+  TEST_CASE("Strict inequality SAT") {
+    context c;
+
+    variable a = c.add_variable("a");
+
+    auto am3 = c.add_linear_expression({{a, 1}}, -3);
+    auto ap2 = c.add_linear_expression({{a, 1}}, 2);
+
+    c.add_constraint(am3, LESS_THAN_ZERO);
+    c.add_constraint(ap2, GREATER_THAN_ZERO);
+
+    maybe<map<variable, rational> > model =
+      c.solve_constraints();
+
+    REQUIRE(model.has_value());
+
+    rational av = model.get_value()[a];
+
+    REQUIRE(av < rational(3));
+    REQUIRE(av > rational(-2));
+  }
+
+  TEST_CASE("Simplest rational between two roots") {
+    REQUIRE(simplest_between(rational(2), rational(5)) == rational(3));
+    REQUIRE(simplest_between(rational(-5, 2), rational(-1, 3)) == rational(-1));
+    REQUIRE(simplest_between(rational(-1, 2), rational(7)) == rational(0));
+    REQUIRE(simplest_between(rational(1, 3), rational(1, 2)) == rational(2, 5));
+    REQUIRE(simplest_between(rational(3, 10), rational(17, 50)) == rational(1, 3));
+    REQUIRE(simplest_between(rational(0), rational(1, 4)) == rational(1, 5));
+    REQUIRE(simplest_between(rational(-7, 3), rational(-2)) == rational(-9, 4));
+  }
+
+  TEST_CASE("Simplest samples are no longer than midpoints") {
+    double midpoint_bits = 0;
+    double simplest_bits = 0;
+
+    for (auto mode : {MIDPOINT_SAMPLES, SIMPLEST_SAMPLES}) {
+      context c;
+      c.set_sample_mode(mode);
+
+      variable a = c.add_variable("a");
+      variable b = c.add_variable("b");
+
+      auto f0 = c.add_linear_expression({{a, 3}, {b, -2}}, -7);
+      auto f1 = c.add_linear_expression({{a, 5}, {b, 5}}, 4);
+      auto f2 = c.add_linear_expression({{a, 7}, {b, 1}}, -1);
+
+      sign_invariant_partition sid =
+        c.build_sign_invariant_partition({f0, f1, f2});
+
+      REQUIRE(sid.num_leaf_cells() == 43);
+
+      double bits = sid.average_sample_bits(1);
+      if (mode == MIDPOINT_SAMPLES) {
+        midpoint_bits = bits;
+      } else {
+        simplest_bits = bits;
+      }
+    }
+
+    REQUIRE(simplest_bits < midpoint_bits);
+  }
+
+  TEST_CASE("Coefficients stay sorted past the inline capacity") {
+    context c;
+
+    std::vector<variable> vars;
+    for (int i = 0; i < 6; i++) {
+      vars.push_back(c.add_variable("x" + std::to_string(i)));
+    }
+
+    linear_expression l({{vars[5], 2}, {vars[1], 4}, {vars[3], -6}, {vars[0], 8}, {vars[4], 2}}, 10);
+    linear_expression r({{vars[2], 3}, {vars[1], 6}, {vars[0], 12}}, 3);
+
+    REQUIRE(l.num_non_zero_coeffs() == 5);
+    REQUIRE(l.get_content() == rational(2));
+
+    int prev = -1;
+    for (const auto& cf : l.integer_coefficients()) {
+      REQUIRE(cf.first > prev);
+      prev = cf.first;
+    }
+
+    // 3*l - 2*r cancels x0 and x1 and introduces x2
+    linear_expression d = l.scalar_mul(rational(3)).subtract(r.scalar_mul(rational(2)));
+    REQUIRE(d.num_non_zero_coeffs() == 4);
+    REQUIRE(d.cof(vars[0]) == rational(0));
+    REQUIRE(d.cof(vars[1]) == rational(0));
+    REQUIRE(d.cof(vars[2]) == rational(-6));
+    REQUIRE(d.cof(vars[3]) == rational(-18));
+    REQUIRE(d.cof(vars[5]) == rational(6));
+    REQUIRE(d.get_const() == rational(24));
+
+    linear_expression dropped = d.drop(vars[3]);
+    REQUIRE(dropped.num_non_zero_coeffs() == 3);
+    REQUIRE(dropped.cof(vars[3]) == rational(0));
+    REQUIRE(dropped.cof(vars[4]) == rational(6));
+
+    REQUIRE(std::is_nothrow_move_constructible<coeff_vector>::value);
+    REQUIRE(std::is_nothrow_move_constructible<linear_expression>::value);
+    REQUIRE(std::is_nothrow_move_assignable<linear_expression>::value);
+  }
+
+  TEST_CASE("Dense rows combine like sparse coefficients") {
+    linear_expression l({{0, 3}, {1, -7}, {3, 5}, {4, 2}}, 9);
+    linear_expression r({{0, 4}, {2, 11}, {3, -5}}, -6);
+    int width = 6;
+
+    expression_matrix rows;
+    rows.add_canonical_row(l);
+    rows.add_canonical_row(r);
+
+    // Falls back to the sparse kernel once a coefficient leaves int32
+    linear_expression wide({{0, 1}, {1, 1}}, 1);
+    rows.add_canonical_row(wide.scalar_mul(rational(1) / rational(3))
+                           .subtract(r.scalar_mul(rational(5000000000LL))));
+
+    for (int a = 0; a < rows.num_rows(); a++) {
+      for (int b = a + 1; b < rows.num_rows(); b++) {
+        expression_matrix sparse;
+        expression_matrix dense;
+        sparse.add_canonical_elimination(rows, a, b, 0, 0, nullptr);
+        dense.add_canonical_elimination(rows, a, b, 0, width, nullptr);
+
+        REQUIRE(sparse.num_rows() == 1);
+        REQUIRE(dense.num_rows() == 1);
+        REQUIRE(sparse.row_expression(0) == dense.row_expression(0));
+        REQUIRE(dense.row_cof(0, 0).sign() == 0);
+      }
+    }
+  }
+
+  TEST_CASE("Dense and sparse projections agree") {
+    std::vector<int> leaves;
+    for (auto layout : {SPARSE_ROWS, DENSE_ROWS}) {
+      context c;
+      c.set_coefficient_layout(layout);
+
+      variable a = c.add_variable("a");
+      variable b = c.add_variable("b");
+
+      auto f0 = c.add_linear_expression({{a, 3}, {b, -2}}, -7);
+      auto f1 = c.add_linear_expression({{a, 5}, {b, 5}}, 4);
+      auto f2 = c.add_linear_expression({{a, 7}, {b, 1}}, -1);
+
+      auto proj = c.project_away({f0, f1, f2}, b);
+      REQUIRE(proj.size() == 3);
+      REQUIRE(*proj[0] == linear_expression({{a, 25}}, -27));
+
+      sign_invariant_partition sid =
+        c.build_sign_invariant_partition({f0, f1, f2});
+      leaves.push_back(sid.num_leaf_cells());
+    }
+
+    REQUIRE(leaves[0] == leaves[1]);
+  }
+
+  TEST_CASE("Equal expressions share one pointer in a context") {
+    context c;
+
+    variable a = c.add_variable("a");
+    variable b = c.add_variable("b");
+    variable d = c.add_variable("d");
+
+    auto f0 = c.add_linear_expression({{a, 2}, {b, 4}}, 6);
+    auto f1 = c.add_linear_expression({{b, 4}, {a, 2}}, 6);
+    auto f2 = c.add_linear_expression(linear_expression({{a, 1}, {b, 2}}, 3).scalar_mul(rational(2)));
+
+    REQUIRE(f0 == f1);
+    REQUIRE(f0 == f2);
+    REQUIRE(c.num_linear_expressions() == 1);
+
+    // Eliminating d from g0, g1 and from g2, g3 gives the same constant
+    auto g0 = c.add_linear_expression({{a, 1}, {d, 1}}, 0);
+    auto g1 = c.add_linear_expression({{a, 1}, {d, 1}}, 1);
+    auto g2 = c.add_linear_expression({{b, 1}, {d, 1}}, 0);
+    auto g3 = c.add_linear_expression({{b, 1}, {d, 1}}, 1);
+
+    // g0, g3 give a - b - 1 and g1, g2 give a - b + 1, while g0, g2 and
+    // g1, g3 both give a - b
+    auto proj = c.project_away({g0, g1, g2, g3}, d);
+    std::set<const linear_expression*> distinct(begin(proj), end(proj));
+
+    REQUIRE(proj.size() == 3);
+    REQUIRE(distinct.size() == proj.size());
+    REQUIRE(c.num_linear_expressions() == 5 + ((int) distinct.size()));
+    REQUIRE(distinct.count(c.add_linear_expression({{a, 1}, {b, -1}}, 0)) == 1);
+    REQUIRE(c.num_linear_expressions() == 5 + ((int) distinct.size()));
+  }
+
+  TEST_CASE("Scalar multiples share one canonical form") {
+    linear_expression l({{0, -2}, {1, 4}}, 6);
+    linear_expression r = l.scalar_mul(rational(-3) / rational(7));
+
+    expression_matrix rows;
+    rows.add_canonical_row(l);
+    rows.add_canonical_row(r);
+
+    REQUIRE(rows.num_rows() == 1);
+    REQUIRE(rows.find_canonical_row(r) == 0);
+    REQUIRE(rows.row_cof(0, 0) == rational(1));
+    REQUIRE(rows.row_cof(0, 1) == rational(-2));
+    REQUIRE(rows.row_const(0) == rational(-3));
+  }
+
+  TEST_CASE("Projection sets drop repeated zero sets") {
+    int single = 0;
+    for (int copies = 1; copies <= 3; copies++) {
+      context c;
+
+      variable a = c.add_variable("a");
+      variable b = c.add_variable("b");
+
+      std::set<const linear_expression*> exprs;
+      exprs.insert(c.add_linear_expression({{a, 1}, {b, -1}}, 0));
+      exprs.insert(c.add_linear_expression({{a, 2}, {b, 1}}, -3));
+      for (int i = 2; i <= copies; i++) {
+        exprs.insert(c.add_linear_expression({{a, -i}, {b, i}}, 0));
+      }
+
+      sign_invariant_partition sid = c.build_sign_invariant_partition(exprs);
+      if (copies == 1) {
+        single = sid.num_leaf_cells();
+      }
+      REQUIRE(sid.num_leaf_cells() == single);
+    }
+  }
+
+  TEST_CASE("Three variable SAT") {
+    context c;
+
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+    variable z = c.add_variable("z");
+
+    auto f0 = c.add_linear_expression({{x, 1}, {y, 1}, {z, 1}}, -1);
+    auto f1 = c.add_linear_expression({{x, 1}, {y, -1}}, 0);
+    auto f2 = c.add_linear_expression({{z, 1}}, -2);
+
+    c.add_constraint(f0, LESS_THAN_ZERO);
+    c.add_constraint(f1, GREATER_THAN_ZERO);
+    c.add_constraint(f2, GREATER_THAN_ZERO);
+
+    auto model = c.solve_constraints();
+
+    REQUIRE(model.has_value());
+    REQUIRE(f0->sign_at(model.get_value()) < 0);
+    REQUIRE(f1->sign_at(model.get_value()) > 0);
+    REQUIRE(f2->sign_at(model.get_value()) > 0);
+  }
+
+  TEST_CASE("Fused elimination matches drop, scale and subtract") {
+    linear_expression l({{0, 6}, {1, -4}, {2, 10}, {4, 3}}, 5);
+    linear_expression r =
+      linear_expression({{1, 9}, {2, -15}, {3, 7}}, -2).scalar_mul(rational(2) / rational(3));
+
+    expression_matrix rows;
+    rows.add_canonical_row(l);
+    rows.add_canonical_row(r);
+
+    for (variable var = 0; var < 5; var++) {
+      linear_expression expected =
+        l.drop(var).scalar_mul(r.cof(var)).subtract(r.drop(var).scalar_mul(l.cof(var)));
+
+      for (int width : {0, 6}) {
+        expression_matrix elim;
+        elim.add_canonical_elimination(rows, 0, 1, var, width, nullptr);
+        if (expected.num_non_zero_coeffs() == 0) {
+          REQUIRE(elim.num_rows() == 0);
+        } else {
+          REQUIRE(elim.find_canonical_row(expected) == 0);
+        }
+      }
+    }
+  }
+
+  TEST_CASE("Projection only pairs expressions that mention the variable") {
+    context c;
+
+    variable a = c.add_variable("a");
+    variable b = c.add_variable("b");
+    variable d = c.add_variable("d");
+
+    auto f0 = c.add_linear_expression({{a, 1}, {d, 1}}, 0);
+    auto f1 = c.add_linear_expression({{b, 1}, {d, -1}}, 2);
+    auto f2 = c.add_linear_expression({{a, 1}, {b, 1}}, 0);
+    auto f3 = c.add_linear_expression({{a, 3}}, -1);
+    auto f4 = c.add_linear_expression({{b, 5}}, 4);
+
+    auto proj = c.project_away({f0, f1, f2, f3, f4}, d);
+
+    // f2, f3 and f4 pass through, f0 and f1 give a + b + 2
+    REQUIRE(proj.size() == 4);
+    REQUIRE(proj[0] == f2);
+    REQUIRE(proj[1] == f3);
+    REQUIRE(proj[2] == f4);
+    REQUIRE(*proj[3] == linear_expression({{a, 1}, {b, 1}}, 2));
+  }
+
+  TEST_CASE("Batched signs match sign_at") {
+    context c;
+
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+
+    std::vector<const linear_expression*> rows{
+      c.add_linear_expression({{x, 1}, {y, 1}}, 0),
+      c.add_linear_expression({{x, 3}, {y, -2}}, 1),
+      c.add_linear_expression({{y, 4}}, -2)};
+    expression_matrix m(rows);
+
+    REQUIRE(m.num_rows() == 3);
+    REQUIRE(m.num_non_zeros() == 5);
+
+    std::vector<std::map<variable, rational> > pts{
+      {{x, rational(1)}, {y, rational(-1)}},
+      {{x, rational(1) / rational(3)}, {y, rational(1)}},
+      {{x, rational(-7)}, {y, rational(1) / rational(2)}},
+      {{x, rational("123456789012345678901234567890")}, {y, rational(2)}}};
+    point_block block(2);
+    for (const auto& pt : pts) {
+      block.add_point(pt);
+    }
+
+    std::vector<int> signs(m.num_rows() * block.num_points());
+    evaluate_signs(m, block, signs.data());
+
+    for (int r = 0; r < m.num_rows(); r++) {
+      for (int p = 0; p < block.num_points(); p++) {
+        REQUIRE(signs[r * block.num_points() + p] == rows[r]->sign_at(pts[p]));
+      }
+    }
+
+    std::vector<rational> values(m.num_rows() * block.num_points());
+    evaluate_values(m, block, values.data());
+
+    for (int r = 0; r < m.num_rows(); r++) {
+      for (int p = 0; p < block.num_points(); p++) {
+        rational direct = rows[r]->get_const() +
+          rows[r]->cof(x) * pts[p][x] + rows[r]->cof(y) * pts[p][y];
+        REQUIRE(values[r * block.num_points() + p] == direct);
+      }
+    }
+  }
+
+  TEST_CASE("CSR projection matches pairwise elimination") {
+    context c;
+
+    variable a = c.add_variable("a");
+    variable b = c.add_variable("b");
+    variable d = c.add_variable("d");
+
+    std::vector<const linear_expression*> exprs{
+      c.add_linear_expression({{a, 2}, {b, -3}, {d, 1}}, 4),
+      c.add_linear_expression({{a, 1}, {d, -2}}, 0),
+      c.add_linear_expression({{b, 6}, {d, 3}}, -9),
+      c.add_linear_expression({{a, -4}, {b, 6}, {d, -2}}, -8),
+      c.add_linear_expression({{a, 5}, {b, 1}}, 1)};
+
+    expression_matrix rows;
+    for (auto expr : exprs) {
+      rows.add_canonical_row(*expr);
+    }
+
+    // The fourth expression is -2 times the first
+    REQUIRE(rows.num_rows() == 4);
+
+    expression_matrix proj = c.project_away(rows, d);
+
+    std::set<int> expected;
+    for (int i = 0; i < (int) exprs.size(); i++) {
+      linear_expression li = *exprs[i];
+      if (li.cof(d).sign() == 0) {
+        expected.insert(proj.find_canonical_row(li));
+      }
+      for (int j = i + 1; j < (int) exprs.size(); j++) {
+        linear_expression lj = *exprs[j];
+        linear_expression res =
+          li.drop(d).scalar_mul(lj.cof(d)).subtract(lj.drop(d).scalar_mul(li.cof(d)));
+        if (res.num_non_zero_coeffs() > 0) {
+          expected.insert(proj.find_canonical_row(res));
+        }
+      }
+    }
+
+    REQUIRE(expected.count(-1) == 0);
+    REQUIRE(proj.num_rows() == (int) expected.size());
+    REQUIRE(c.project_away(exprs, d).size() == expected.size());
+    for (int r = 0; r < proj.num_rows(); r++) {
+      REQUIRE(proj.row_cof(r, d).sign() == 0);
+    }
+
+    REQUIRE(proj.footprint_bytes() > proj.num_non_zeros() * sizeof(rational));
+
+    sign_invariant_partition sid =
+      c.build_sign_invariant_partition(std::set<const linear_expression*>(begin(exprs), end(exprs)));
+    REQUIRE(sid.projection_footprint_bytes() >= rows.footprint_bytes());
+  }
+
+  TEST_CASE("Rows solved for the lifting variable") {
+    expression_matrix rows;
+    rows.add_canonical_row(linear_expression({{0, 2}, {1, 3}}, -6));
+    rows.add_canonical_row(linear_expression({{0, 1}}, 4));
+    rows.add_canonical_row(linear_expression({{1, -4}, {2, 1}}, 2));
+
+    // The second row does not mention variable 1
+    expression_matrix solved = rows.solved_for(1);
+    REQUIRE(solved.num_rows() == 2);
+
+    // 2x + 3y - 6 = 0 at y = 2 - 2x / 3
+    REQUIRE(solved.row_const(0) == rational(2));
+    REQUIRE(solved.row_end(0) - solved.row_begin(0) == 1);
+    REQUIRE(solved.entry_var(solved.row_begin(0)) == 0);
+    REQUIRE(solved.entry_coeff(solved.row_begin(0)) == rational(-2) / rational(3));
+
+    // The canonical form 4y - z - 2 = 0 at y = z / 4 + 1 / 2
+    REQUIRE(solved.row_const(1) == rational(1) / rational(2));
+    REQUIRE(solved.entry_var(solved.row_begin(1)) == 2);
+    REQUIRE(solved.entry_coeff(solved.row_begin(1)) == rational(1) / rational(4));
+  }
+
+  TEST_CASE("Three variable equalities meet at one point") {
+    context c;
+
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+    variable z = c.add_variable("z");
+
+    auto f0 = c.add_linear_expression({{x, 1}, {y, 1}, {z, 1}}, -6);
+    auto f1 = c.add_linear_expression({{x, 1}, {y, -1}}, 1);
+    auto f2 = c.add_linear_expression({{y, 1}, {z, 1}}, -5);
+
+    c.add_constraint(f0, EQUAL_ZERO);
+    c.add_constraint(f1, EQUAL_ZERO);
+    c.add_constraint(f2, EQUAL_ZERO);
+
+    auto model = c.solve_constraints();
+
+    REQUIRE(model.has_value());
+    REQUIRE(model.get_value()[x] == rational(1));
+    REQUIRE(model.get_value()[y] == rational(2));
+    REQUIRE(model.get_value()[z] == rational(3));
+  }
+
+  TEST_CASE("Projected rows are evaluated from their parents") {
+    context c;
+
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+    variable z = c.add_variable("z");
+
+    std::set<const linear_expression*> exprs{
+      c.add_linear_expression({{x, 1}, {y, 2}, {z, -1}}, 3),
+      c.add_linear_expression({{x, -3}, {y, 1}, {z, 4}}, -2),
+      c.add_linear_expression({{x, 2}, {z, 5}}, 7),
+      c.add_linear_expression({{y, 6}, {z, -2}}, 1)};
+
+    REQUIRE(!c.project(exprs)[1].has_provenance());
+
+    c.set_record_provenance(true);
+    std::vector<expression_matrix> levels = c.project(exprs);
+    REQUIRE(levels.size() == 3);
+    REQUIRE(levels[2].num_rows() > 0);
+
+    std::map<variable, rational> pt{{x, rational(2) / rational(3)},
+                                    {y, rational(-5)},
+                                    {z, rational(7) / rational(2)}};
+
+    std::vector<std::vector<rational> > values;
+    evaluate_projection(levels, pt, values);
+
+    for (int l = 0; l < (int) levels.size(); l++) {
+      for (int r = 0; r < levels[l].num_rows(); r++) {
+        rational direct = levels[l].row_const(r);
+        for (int k = levels[l].row_begin(r); k < levels[l].row_end(r); k++) {
+          direct += levels[l].entry_coeff(k) * pt[levels[l].entry_var(k)];
+        }
+        REQUIRE(values[l][r] == direct);
+      }
+    }
+  }
+
+  TEST_CASE("Packed sign vectors against compiled constraints") {
+    std::vector<value_constraint> kinds{EQUAL_ZERO, NOT_EQUAL_ZERO,
+                                        LESS_THAN_ZERO, GREATER_THAN_ZERO};
+
+    // More constraints than fit in one word
+    std::vector<constraint> constraints;
+    for (int i = 0; i < 40; i++) {
+      constraints.push_back({nullptr, kinds[i % 4]});
+    }
+    sign_pattern pattern = compile_constraints(constraints);
+
+    sign_vectors svs(constraints.size());
+    REQUIRE(svs.num_words() == 2);
+
+    for (int wrong = -1; wrong < 40; wrong++) {
+      int v = svs.add_vector();
+      for (int i = 0; i < 40; i++) {
+        int sign = 0;
+        switch (kinds[i % 4]) {
+        case EQUAL_ZERO: sign = i == wrong ? 1 : 0; break;
+        case NOT_EQUAL_ZERO: sign = i == wrong ? 0 : (i % 8 == 1 ? -1 : 1); break;
+        case LESS_THAN_ZERO: sign = i == wrong ? 0 : -1; break;
+        case GREATER_THAN_ZERO: sign = i == wrong ? -1 : 1; break;
+        }
+        svs.set(v, i, sign);
+        REQUIRE(svs.get(v, i) == sign);
+      }
+      REQUIRE(pattern.matches(svs.vector_words(v)) == (wrong == -1));
+    }
+
+    REQUIRE(pattern.first_match(svs) == 0);
+
+    int copy = svs.add_vector();
+    for (int i = 0; i < 40; i++) {
+      svs.set(copy, i, svs.get(3, i));
+    }
+    REQUIRE(svs.same_vector(copy, 3));
+    REQUIRE(svs.distinct_vectors().size() == 41);
+  }
+
+  TEST_CASE("Lifting records the sign of every input at each leaf") {
+    context c;
+
+    variable x = c.add_variable("x");
+    variable y = c.add_variable("y");
+    variable z = c.add_variable("z");
+
+    std::vector<const linear_expression*> inputs{
+      c.add_linear_expression({{x, 1}, {y, 2}, {z, -1}}, 3),
+      c.add_linear_expression({{x, -3}, {z, 4}}, -2),
+      c.add_linear_expression({{x, 2}, {y, -5}}, 7),
+      c.add_linear_expression({{x, -2}, {y, 5}}, 1)};
+
+    std::set<const linear_expression*> exprs(begin(inputs), end(inputs));
+    sign_invariant_partition sid = c.build_sign_invariant_partition(exprs);
+
+    std::vector<const linear_expression*> ordered(begin(exprs), end(exprs));
+    const sign_vectors& signs = sid.leaf_sign_vectors();
+    auto pts = sid.test_points();
+
+    REQUIRE(signs.num_vectors() == (int) pts.size());
+    for (int p = 0; p < (int) pts.size(); p++) {
+      for (int k = 0; k < (int) ordered.size(); k++) {
+        REQUIRE(signs.get(p, k) == ordered[k]->sign_at(pts[p]));
+      }
+    }
+  }
+
+  TEST_CASE("Fixed dimension solver agrees with the general one") {
+    std::vector<value_constraint> kinds{EQUAL_ZERO, NOT_EQUAL_ZERO,
+                                        LESS_THAN_ZERO, GREATER_THAN_ZERO};
+    unsigned seed = 12345;
+    auto next = [&seed](const int range) {
+      seed = seed * 1103515245 + 12345;
+      return (int) ((seed >> 16) % range);
+    };
+
+    // The last trials have no constraints, on up to 5 variables
+    int num_constrained = 24;
+    int num_trials = num_constrained + 5;
+    int num_sat = 0;
+    for (int trial = 0; trial < num_trials; trial++) {
+      int n = trial < num_constrained ? 1 + trial % 4 : trial - num_constrained + 1;
+      int num_cons = trial < num_constrained ? 3 : 0;
+
+      std::vector<bool> sat;
+      for (bool fixed : {true, false}) {
+        unsigned trial_seed = seed;
+
+        context c;
+        c.set_fixed_dimensions(fixed);
+        std::vector<variable> vars;
+        for (int v = 0; v < n; v++) {
+          vars.push_back(c.add_variable("v" + std::to_string(v)));
+        }
+
+        std::vector<constraint> cons;
+        for (int k = 0; k < num_cons; k++) {
+          std::vector<std::pair<variable, int> > coeffs;
+          for (auto v : vars) {
+            coeffs.push_back({v, next(7) - 3});
+          }
+          auto e = c.add_linear_expression(coeffs, next(9) - 4);
+          value_constraint kind = kinds[next(4)];
+          c.add_constraint(e, kind);
+          cons.push_back({e, kind});
+        }
+
+        auto model = c.solve_constraints();
+        sat.push_back(model.has_value());
+        if (num_cons == 0) {
+          REQUIRE(model.has_value());
+          REQUIRE((int) model.get_value().size() == n);
+        }
+        if (model.has_value()) {
+          sign_pattern pattern = compile_constraints(cons);
+          sign_vectors svs(cons.size());
+          svs.add_vector();
+          for (int k = 0; k < (int) cons.size(); k++) {
+            svs.set(0, k, cons[k].first->sign_at(model.get_value()));
+          }
+          REQUIRE(pattern.matches(svs.vector_words(0)));
+        }
+
+        if (fixed) {
+          seed = trial_seed;
+        }
+      }
+
+      REQUIRE(sat[0] == sat[1]);
+      num_sat += sat[0];
+    }
+
+    REQUIRE(num_sat > 0);
+    REQUIRE(num_sat < num_trials);
+  }
+
+  TEST_CASE("Test points are visited in place") {
+    context c;
+
+    variable a = c.add_variable("a");
+    variable b = c.add_variable("b");
+
+    std::set<const linear_expression*> exprs;
+    exprs.insert(c.add_linear_expression({{a, 1}, {b, -1}}, 0));
+    exprs.insert(c.add_linear_expression({{a, 2}, {b, 1}}, -3));
+
+    sign_invariant_partition sid = c.build_sign_invariant_partition(exprs);
+    auto copies = sid.test_points();
+    auto refs = sid.test_point_refs();
+    REQUIRE((int) refs.size() == sid.num_leaf_cells());
+    REQUIRE(refs.size() == copies.size());
+    for (int i = 0; i < (int) refs.size(); i++) {
+      REQUIRE(*refs[i] == copies[i]);
+      REQUIRE(find_value(a, *refs[i]) != nullptr);
+      REQUIRE(*find_value(a, *refs[i]) == copies[i][a]);
+    }
+    REQUIRE(find_value(b + 1, *refs[0]) == nullptr);
+
+    maybe<std::map<variable, rational> > m(std::move(copies[0]));
+    const rational* ma = &(m.get_value()[a]);
+    REQUIRE(&(m.get_value().find(a)->second) == ma);
+    std::map<variable, rational> taken = std::move(m).get_value();
+    REQUIRE(taken == *refs[0]);
+  }
+
+  TEST_CASE("Expression arena destroys only expressions that own heap memory") {
+    context c;
+
+    std::vector<variable> vars;
+    for (int i = 0; i < 6; i++) {
+      vars.push_back(c.add_variable("x" + std::to_string(i)));
+    }
+
+    for (int i = 0; i < 600; i++) {
+      c.add_linear_expression({{vars[0], 1}, {vars[1], i + 1}}, -i);
+    }
+
+    std::vector<std::pair<variable, int> > wide;
+    for (auto v : vars) {
+      wide.push_back({v, 1});
+    }
+    const linear_expression* spilled = c.add_linear_expression(wide, 1);
+    REQUIRE(spilled->owns_heap());
+
+    const linear_expression* big =
+      c.add_linear_expression(linear_expression({{vars[2], rational("3/2")}},
+                                                rational("123456789012345678901234567")));
+    REQUIRE(big->owns_heap());
+
+    const expression_arena& store = c.expression_storage();
+    REQUIRE(store.size() == c.num_linear_expressions());
+    REQUIRE(store.size() == 602);
+    REQUIRE(store.num_chunks() == 3);
+    REQUIRE(store.num_owning_heap() == 2);
+    REQUIRE(spilled->integer_coefficients().size() == 6);
+    REQUIRE(c.add_linear_expression(wide, 1) == spilled);
+  }
+
 }
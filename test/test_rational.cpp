@@ -0,0 +1,320 @@
+#include <cstdlib>
+#include <sstream>
+#include <type_traits>
+
+#include "catch.hpp"
+
+#include "filter.h"
+#include "gmp_pool.h"
+#include "rational.h"
+
+namespace LinCAD {
+
+  TEST_CASE("Small rationals stay inline") {
+    rational a(3, 4);
+    rational b(-1, 6);
+
+    rational s = a + b;
+
+    REQUIRE(s.is_small());
+    REQUIRE(s == rational("7/12"));
+    REQUIRE((a * b) == rational("-1/8"));
+    REQUIRE((a / b) == rational("-9/2"));
+    REQUIRE(rational(4, -8) == rational(-1, 2));
+  }
+
+  TEST_CASE("Overflowing rationals are promoted to GMP and demoted back") {
+    rational max("9223372036854775807");
+
+    REQUIRE(max.is_small());
+
+    rational big = max + rational(1);
+
+    REQUIRE(!big.is_small());
+    REQUIRE(big == rational("9223372036854775808"));
+
+    rational back = big - rational(1);
+
+    REQUIRE(back.is_small());
+    REQUIRE(back == max);
+
+    rational sq = max * max;
+
+    REQUIRE(!sq.is_small());
+    REQUIRE((sq / max) == max);
+    REQUIRE((sq / max).is_small());
+  }
+
+  TEST_CASE("Moving a big rational steals its value") {
+    rational big = rational("9223372036854775807") * rational(4);
+    rational expected = big;
+
+    REQUIRE(!expected.is_small());
+
+    rational moved(std::move(big));
+
+    REQUIRE(moved == expected);
+    REQUIRE(big.is_small());
+    REQUIRE(big.sign() == 0);
+
+    rational assigned;
+    assigned = std::move(moved);
+
+    REQUIRE(assigned == expected);
+    REQUIRE(moved.sign() == 0);
+
+    rational copy = assigned;
+    copy = copy + rational(1);
+
+    REQUIRE(assigned == expected);
+
+    // Vectors move rationals on reallocation only when this holds
+    REQUIRE(std::is_nothrow_move_constructible<rational>::value);
+    REQUIRE(std::is_nothrow_move_assignable<rational>::value);
+  }
+
+  TEST_CASE("Compound assignment and fused multiply-add") {
+    rational max("9223372036854775807");
+
+    rational acc(1, 2);
+    acc += rational(1, 3);
+    acc *= rational(6);
+
+    REQUIRE(acc == rational(5));
+
+    acc.addmul(max, rational(2));
+
+    REQUIRE(!acc.is_small());
+
+    acc.submul(max, rational(2));
+
+    REQUIRE(acc.is_small());
+    REQUIRE(acc == rational(5));
+
+    acc /= rational(-10);
+    acc -= rational(1, 2);
+
+    REQUIRE(acc == rational::minus_one());
+  }
+
+  TEST_CASE("Comparing rationals") {
+    rational max("9223372036854775807");
+    rational big = max * max;
+
+    REQUIRE(rational(1, 3) < rational(1, 2));
+    REQUIRE(rational(-1, 2) < rational(-1, 3));
+    REQUIRE(rational(2, 4) <= rational(1, 2));
+    REQUIRE(rational(1, 2).compare(rational(2, 4)) == 0);
+    REQUIRE(max < big);
+    REQUIRE(-big < rational::zero());
+    REQUIRE(rational(INT64_MAX, 3) > rational(INT64_MAX - 1, 5));
+  }
+
+  TEST_CASE("Building a rational from an mpz") {
+    mpz_t z;
+    mpz_init_set_si(z, -42);
+
+    rational r(z);
+
+    REQUIRE(r.is_small());
+    REQUIRE(r == rational(-42));
+
+    mpz_mul_2exp(z, z, 100);
+    rational big(z);
+
+    REQUIRE(!big.is_small());
+    REQUIRE(big < r);
+
+    mpz_clear(z);
+  }
+
+  TEST_CASE("Big rationals built inside an arena use pooled limbs") {
+    gmp_pool_stats before = gmp_pool_statistics();
+
+    rational outlives;
+    {
+      gmp_arena arena;
+
+      rational max("9223372036854775807");
+      rational acc = max;
+      for (int i = 0; i < 10; i++) {
+        acc *= max;
+      }
+      acc /= max;
+
+      outlives = acc;
+    }
+
+    gmp_pool_stats inside = gmp_pool_statistics();
+
+    REQUIRE(inside.pooled_allocs > before.pooled_allocs);
+    REQUIRE(inside.arenas_released == before.arenas_released);
+    REQUIRE(outlives.sign() == 1);
+
+    outlives = rational::zero();
+
+    REQUIRE(gmp_pool_statistics().arenas_released ==
+            before.arenas_released + 1);
+  }
+
+  TEST_CASE("Limbs allocated outside the pool stay valid") {
+    // As if allocated by GMP before the pool was installed
+    mpz_t z;
+    z->_mp_alloc = 1;
+    z->_mp_size = 1;
+    z->_mp_d = static_cast<mp_limb_t*>(std::malloc(sizeof(mp_limb_t)));
+    z->_mp_d[0] = 7;
+
+    {
+      gmp_arena arena;
+      mpz_mul_2exp(z, z, 200);
+      mpz_mul_ui(z, z, 3);
+    }
+    mpz_mul_2exp(z, z, 2000);
+    mpz_tdiv_q_2exp(z, z, 2200);
+
+    REQUIRE(mpz_cmp_ui(z, 21) == 0);
+    mpz_clear(z);
+
+    mpz_t w;
+    w->_mp_alloc = 1;
+    w->_mp_size = 1;
+    w->_mp_d = static_cast<mp_limb_t*>(std::malloc(sizeof(mp_limb_t)));
+    w->_mp_d[0] = 5;
+    mpz_mul_2exp(w, w, 5000);
+    REQUIRE(mpz_sizeinbase(w, 2) == 5003);
+    mpz_clear(w);
+  }
+
+  TEST_CASE("Interning big rationals shares one value") {
+    rational max("9223372036854775807");
+    rational x = max * rational(3);
+    rational y = rational(3) * max;
+    rational z = x + rational(1);
+
+    {
+      rational_table table;
+      table.intern(x);
+      table.intern(y);
+      table.intern(z);
+
+      REQUIRE(table.size() == 2);
+      REQUIRE(x.is_interned());
+      REQUIRE(x == y);
+      REQUIRE(x != z);
+      REQUIRE(std::hash<rational>()(x) == std::hash<rational>()(y));
+
+      y += rational(1);
+
+      REQUIRE(!y.is_interned());
+      REQUIRE(y == z);
+      REQUIRE(x == max * rational(3));
+    }
+
+    REQUIRE(!x.is_interned());
+    REQUIRE(x == max * rational(3));
+  }
+
+  TEST_CASE("gcd of rationals") {
+    REQUIRE(gcd(rational(12), rational(-18)) == rational(6));
+    REQUIRE(gcd(rational(1, 2), rational(3, 4)) == rational(1, 4));
+    REQUIRE(gcd(rational(0), rational(-5, 3)) == rational(5, 3));
+    REQUIRE(gcd(rational(0), rational(0)) == rational(0));
+
+    rational max("9223372036854775807");
+    REQUIRE(gcd(max * rational(6), max * rational(4)) == max * rational(2));
+    REQUIRE(rational(7).is_integer());
+    REQUIRE(!rational(7, 2).is_integer());
+  }
+
+  TEST_CASE("Sorting on interval enclosures") {
+    rational third(1, 3);
+    rational near_third(333333333333333333LL, 1000000000000000000LL);
+
+    reset_filter_statistics();
+
+    std::vector<rational> sorted =
+      filtered_sort_unique({rational(5), third, rational(-2), near_third, rational(5), third});
+
+    REQUIRE(sorted.size() == 4);
+    REQUIRE(sorted[0] == rational(-2));
+    REQUIRE(sorted[1] == near_third);
+    REQUIRE(sorted[2] == third);
+    REQUIRE(sorted[3] == rational(5));
+
+    filter_stats stats = filter_statistics();
+
+    REQUIRE(stats.hits > 0);
+    REQUIRE(stats.misses > 0);
+
+    interval i = to_interval(third);
+
+    REQUIRE(i.lo < 1.0 / 3.0);
+    REQUIRE(i.hi > 1.0 / 3.0);
+  }
+
+  TEST_CASE("Enclosures of wide fractions contain their value") {
+    std::vector<rational> cases{
+      rational(4953177724907161159, 5035039428645966282),
+      rational(-4953177724907161159, 5035039428645966282),
+      rational(9007199254740993, 3),
+      rational(1, 9007199254740993),
+      rational(INT64_MAX, INT64_MAX - 2),
+      rational("123456789012345678901234567/7")};
+
+    mpq_t bound;
+    mpq_init(bound);
+    for (const auto& r : cases) {
+      interval i = to_interval(r);
+      mpq_t val;
+      mpq_init(val);
+      std::ostringstream ss;
+      ss << r;
+      mpq_set_str(val, ss.str().c_str(), 10);
+      mpq_canonicalize(val);
+
+      mpq_set_d(bound, i.lo);
+      REQUIRE(mpq_cmp(bound, val) <= 0);
+      mpq_set_d(bound, i.hi);
+      REQUIRE(mpq_cmp(bound, val) >= 0);
+      mpq_clear(val);
+    }
+    mpq_clear(bound);
+  }
+
+  TEST_CASE("Roots are sorted in place on every path") {
+    root_sort_buffer buf;
+
+    std::vector<std::vector<rational> > cases;
+
+    // Few roots over a common denominator, sorted by comparison
+    cases.push_back({rational(3, 4), rational(-1, 2), rational(3, 4), rational(0), rational(-5, 6)});
+
+    // Enough roots for the radix sort, including negatives and repeats
+    std::vector<rational> many;
+    for (int i = 0; i < 200; i++) {
+      many.push_back(rational((i * 7919) % 311 - 150, 1 + (i % 4)));
+    }
+    cases.push_back(many);
+
+    // Denominators whose lcm leaves int64
+    cases.push_back({rational(1, 1000000007), rational(1, 998244353),
+                     rational(-3, 1000000009), rational(2, 999999937),
+                     rational(1, 1000000007)});
+
+    // Big roots
+    cases.push_back({rational("100000000000000000000000000001"), rational(2),
+                     rational("-100000000000000000000000000001"), rational(2)});
+
+    for (auto& roots : cases) {
+      std::vector<rational> expected = filtered_sort_unique(roots);
+      sort_unique_roots(roots, buf);
+
+      REQUIRE(roots.size() == expected.size());
+      for (int i = 0; i < (int) roots.size(); i++) {
+        REQUIRE(roots[i] == expected[i]);
+      }
+    }
+  }
+
+}
@@ -1,5 +1,7 @@
 #include "catch.hpp"
 
+#include "context.h"
+
 namespace LinCAD {
 
   TEST_CASE("Load from smt2") {